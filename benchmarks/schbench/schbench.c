@@ -18,14 +18,25 @@
 #include <sys/time.h>
 #include <time.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sched.h>
+#include <math.h>
 #include <linux/futex.h>
 #include <sys/syscall.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "perf_event.h"
 #include <assert.h>
 
 #define BUFFER_LENGTH	(1024*2048*8)
 #define CPUMASKSIZE	1024
+#define CACHELINE_SIZE	64
 
 #define USERSPACE_ONLY
 
@@ -123,17 +134,103 @@ static void read_counters(int tid)
 	cache_refs_total[tid] += cache_refs;
 	cache_miss_total[tid] += cache_misses;
 }
+
+/*
+ * --cache-sweep counts these in every message thread and worker for the
+ * whole of each step, kernel time too when perf_event_paranoid lets us
+ */
+enum {
+	SWEEP_CYCLES = 0,
+	SWEEP_INSNS,
+	SWEEP_LLC_LOADS,
+	SWEEP_LLC_MISSES,
+	SWEEP_DTLB_MISSES,
+	SWEEP_EVENTS,
+};
+
+#define HW_CACHE_EVENT(cache, result) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+static struct {
+	unsigned int type;
+	unsigned long long config;
+} sweep_events[SWEEP_EVENTS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_LL,
+					     PERF_COUNT_HW_CACHE_RESULT_ACCESS) },
+	{ PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_LL,
+					     PERF_COUNT_HW_CACHE_RESULT_MISS) },
+	{ PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+					     PERF_COUNT_HW_CACHE_RESULT_MISS) },
+};
+
+/* open the sweep group for the calling thread, -1 if we can't have it */
+static int open_sweep_counters(void)
+{
+	struct perf_event_attr attr;
+	int fds[SWEEP_EVENTS];
+	int user_only = 0;
+	int i;
+
+again:
+	for (i = 0; i < SWEEP_EVENTS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = sweep_events[i].type;
+		attr.config = sweep_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = user_only;
+		attr.exclude_hv = 1;
+		fds[i] = sys_perf_event_open(&attr, 0, -1, i ? fds[0] : -1, 0);
+		if (fds[i] < 0)
+			break;
+	}
+	if (i == SWEEP_EVENTS)
+		return fds[0];
+
+	while (--i >= 0)
+		close(fds[i]);
+	if ((errno == EACCES || errno == EPERM) && !user_only) {
+		user_only = 1;
+		goto again;
+	}
+	return -1;
+}
+
+/* the counts since the last call go in step[] */
+static void read_sweep_counters(int fd, unsigned long long *last,
+				unsigned long long *step)
+{
+	struct {
+		unsigned long long nr;
+		unsigned long long vals[SWEEP_EVENTS];
+	} buf;
+	int i;
+
+	if (fd < 0 || read(fd, &buf, sizeof(buf)) != sizeof(buf)) {
+		memset(step, 0, SWEEP_EVENTS * sizeof(*step));
+		return;
+	}
+	for (i = 0; i < SWEEP_EVENTS; i++) {
+		step[i] = buf.vals[i] - last[i];
+		last[i] = buf.vals[i];
+	}
+}
 // PMU SETUP COMPLETED
 
+/* latencies are in nsec, 25 groups cover the whole 32 bit range */
 #define PLAT_BITS	8
 #define PLAT_VAL	(1 << PLAT_BITS)
-#define PLAT_GROUP_NR	19
+#define PLAT_GROUP_NR	25
 #define PLAT_NR		(PLAT_GROUP_NR * PLAT_VAL)
 #define PLAT_LIST_MAX	20
 
 /* when -p is on, how much do we send back and forth */
 #define PIPE_TRANSFER_BUFFER (1 * 1024 * 1024)
 
+/* -R preallocated requests per worker */
+#define REQUEST_POOL_SIZE 256
+
 /* -m number of message threads */
 static int message_threads = 2;
 /* -t  number of workers per message thread */
@@ -152,10 +249,171 @@ static int pipe_test = 0;
 static int cache_test = 0;
 /* -R requests per sec */
 static int requests_per_sec = 0;
+/* -C clock source for latency timestamps, tsc or raw (CLOCK_MONOTONIC_RAW) */
+static int use_tsc = 0;
+/* tsc to nsec multiplier, 32.32 fixed point */
+static unsigned long long tsc_mult;
+
+/*
+ * --placement classes, where a message thread's workers run relative to
+ * it.  Message threads take the listed classes round robin.
+ */
+enum {
+	PLACE_NONE = 0,
+	PLACE_SMT,		/* siblings of the message thread's SMT core */
+	PLACE_LLC,		/* other cores sharing its last level cache */
+	PLACE_XLLC,		/* cores behind a different llc */
+	PLACE_XNUMA,		/* cpus on a different numa node */
+	PLACE_NR,
+};
+static char *placement_names[PLACE_NR] = { "none", "smt", "llc", "xllc", "xnuma" };
+static int placements[PLACE_NR];
+static int nr_placements = 0;
+/*
+ * -A rps arrival process.  batch is the original fixed wakeup batches,
+ * the rest are open loop: every request is stamped with when it should
+ * have arrived and sent then, or at once if we've fallen behind
+ */
+enum {
+	ARRIVAL_BATCH = 0,
+	ARRIVAL_CONSTANT,
+	ARRIVAL_POISSON,
+	ARRIVAL_TRACE,
+};
+static int arrival = ARRIVAL_BATCH;
+/* --arrival-trace gaps between requests, in nsec, replayed in a loop */
+static unsigned long long *arrival_trace;
+static int nr_arrival_trace;
+
+/*
+ * --slo p99 target (usec).  Instead of a single run the threads are kept
+ * and the rps target is bisected to the highest rate whose p99 stays
+ * under it, measuring each rate for --window seconds after a warmup
+ */
+static double slo_p99 = 0;
+static int slo_window = 2;
+#define SLO_WARMUP	1
+#define SLO_MAX_STEPS	32
+
+/* --per-cpu, --per-msg and --json output */
+static int per_cpu_stats = 0;
+static int per_msg_stats = 0;
+static int json_output = 0;
+
+/* with --json only the object goes to stdout, the text reports go to stderr */
+static FILE *text_out(void)
+{
+	return json_output ? stderr : stdout;
+}
 
 /* the message threads flip this to true when they decide runtime is up */
 static volatile unsigned long stopping = 0;
 
+/*
+ * autobench keeps its threads from one step to the next.  Once a step is
+ * up everyone parks in phase_park(), main collects the stats, changes
+ * requests_per_sec or worker_threads and bumps phase to let them go.
+ * Workers past worker_threads stay parked until they're wanted again
+ */
+static pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t phase_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t parked_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long phase = 0;
+static int nr_parked = 0;
+static int phase_done = 0;
+static int persistent = 0;
+
+/*
+ * -w how workers and message threads kick each other.  The futex word
+ * keeps its protocol in every mode, the others only change how a blocked
+ * thread sleeps and how it gets poked
+ */
+enum {
+	WAKE_FUTEX = 0,
+	WAKE_EVENTFD,
+	WAKE_PIPE,
+	WAKE_SOCKET,
+	WAKE_EPOLL,
+	WAKE_NR,
+};
+static char *wakeup_names[WAKE_NR] = { "futex", "eventfd", "pipe", "socket", "epoll" };
+static int wakeup = WAKE_FUTEX;
+
+/*
+ * -k what workers do for their cputime.  spin is the original clock
+ * polling loop, the others run a kernel calibrated to loops per usec at
+ * startup: integer ALU, FP, a cache resident working set or a memory
+ * streaming one of --footprint KB
+ */
+enum {
+	THINK_SPIN = 0,
+	THINK_ALU,
+	THINK_FP,
+	THINK_CACHE,
+	THINK_STREAM,
+	THINK_NR,
+};
+static char *think_names[THINK_NR] = { "spin", "alu", "fp", "cache", "stream" };
+static int think = THINK_SPIN;
+static unsigned long think_kb = 0;
+static double think_loops_per_usec;
+
+/* --warmup seconds, latencies aren't recorded until main clears warming */
+static int warmup = 0;
+static volatile int warming = 0;
+/* --interval seconds between percentile lines */
+static int interval = 0;
+
+/*
+ * --cache-sweep min:max KB.  Each step is a -l run of runtime seconds with
+ * the working set doubled from min until it gets to max, reusing the
+ * threads like autobench does
+ */
+static unsigned long sweep_min_kb = 0;
+static unsigned long sweep_max_kb = 0;
+static unsigned long sweep_kb = 0;
+
+/*
+ * --procs runs each message thread and its workers as a process of its
+ * own.  With --cgroup each one goes in <cgroup>/msgN, and every
+ * --cgroup-set file=val[,val...] is written into each msgN with the
+ * values handed out round robin
+ */
+static int procs = 0;
+static char *cgroup_name = NULL;
+static int cgroup_created = 0;
+#define CGROUP_SET_MAX 16
+static char *cgroup_sets[CGROUP_SET_MAX];
+static int nr_cgroup_sets = 0;
+
+/*
+ * --hist-out saves the raw histograms at exit, --hist-merge reads the
+ * files named on the command line instead of running, adds them up and
+ * reports (or --hist-out's) the result
+ */
+static char *hist_out = NULL;
+static int hist_merge = 0;
+static char **hist_files;
+static int nr_hist_files = 0;
+
+/*
+ * --locality sorts wakeup latencies by how far the waker's cpu was from
+ * the cpu the wakee woke on, and by how far the wakee moved while it
+ * slept.  loc_stats has LOC_NR of each, waker first
+ */
+enum {
+	LOC_CPU = 0,
+	LOC_SMT,
+	LOC_LLC,
+	LOC_NODE,
+	LOC_XNODE,
+	LOC_UNKNOWN,
+	LOC_NR,
+};
+static char *locality_names[LOC_NR] = { "cpu", "smt", "llc", "node", "xnode", "unknown" };
+static int locality = 0;
+static struct stats *loc_stats;
+
 
 /*
  * one stat struct per thread data, when the workers sleep this records the
@@ -170,6 +428,47 @@ struct stats {
 	unsigned int min;
 };
 
+/*
+ * the same with 64 bit counts, for --hist-merge where adding up enough
+ * runs overflows struct stats
+ */
+struct wide_stats {
+	unsigned long long plat[PLAT_NR];
+	unsigned long long nr_samples;
+	unsigned int max;
+	unsigned int min;
+};
+
+/*
+ * --hist-out files are a hist_header and then nr_hists of a hist_record
+ * followed by nr_buckets {index, count} pairs for its non-zero buckets.
+ * Counts are 64 bit so a merge of merges can be saved again.
+ * Everything is host endian, the magic catches a mismatch.  The bucket
+ * scheme is plat_bits and plat_groups of ns; a file only merges with
+ * ones that agree on it
+ */
+#define HIST_MAGIC	0x48424353
+#define HIST_VERSION	2
+#define HIST_NAME_LEN	16
+
+struct hist_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t plat_bits;
+	uint32_t plat_groups;
+	uint32_t nr_hists;
+	uint32_t pad;
+};
+
+struct hist_record {
+	char name[HIST_NAME_LEN];
+	uint64_t nr_samples;
+	uint32_t min;
+	uint32_t max;
+	uint32_t nr_buckets;
+	uint32_t pad;
+};
+
 /* this defines which latency profiles get printed */
 #define PLIST_P99 4
 #define PLIST_P95 3
@@ -177,9 +476,25 @@ static double plist[PLAT_LIST_MAX] = { 50.0, 75.0, 90.0, 95.0, 99.0, 99.5, 99.9
 
 enum {
 	HELP_LONG_OPT = 1,
+	PER_CPU_LONG_OPT,
+	PER_MSG_LONG_OPT,
+	JSON_LONG_OPT,
+	ARRIVAL_TRACE_LONG_OPT,
+	SLO_LONG_OPT,
+	WINDOW_LONG_OPT,
+	WARMUP_LONG_OPT,
+	INTERVAL_LONG_OPT,
+	FOOTPRINT_LONG_OPT,
+	PROCS_LONG_OPT,
+	CGROUP_LONG_OPT,
+	CGROUP_SET_LONG_OPT,
+	HIST_OUT_LONG_OPT,
+	HIST_MERGE_LONG_OPT,
+	CACHE_SWEEP_LONG_OPT,
+	LOCALITY_LONG_OPT,
 };
 
-char *option_string = "p:am:t:s:c:r:R:l:";
+char *option_string = "p:am:t:s:c:r:R:l:C:P:A:w:k:";
 static struct option long_options[] = {
 	{"auto", no_argument, 0, 'a'},
 	{"pipe", required_argument, 0, 'p'},
@@ -190,6 +505,27 @@ static struct option long_options[] = {
 	{"sleeptime", required_argument, 0, 's'},
 	{"cputime", required_argument, 0, 'c'},
 	{"cachetest", required_argument, 0, 'l'},
+	{"clock", required_argument, 0, 'C'},
+	{"placement", required_argument, 0, 'P'},
+	{"arrival", required_argument, 0, 'A'},
+	{"wakeup", required_argument, 0, 'w'},
+	{"think", required_argument, 0, 'k'},
+	{"footprint", required_argument, 0, FOOTPRINT_LONG_OPT},
+	{"procs", no_argument, 0, PROCS_LONG_OPT},
+	{"cgroup", required_argument, 0, CGROUP_LONG_OPT},
+	{"cgroup-set", required_argument, 0, CGROUP_SET_LONG_OPT},
+	{"hist-out", required_argument, 0, HIST_OUT_LONG_OPT},
+	{"hist-merge", no_argument, 0, HIST_MERGE_LONG_OPT},
+	{"cache-sweep", required_argument, 0, CACHE_SWEEP_LONG_OPT},
+	{"locality", no_argument, 0, LOCALITY_LONG_OPT},
+	{"arrival-trace", required_argument, 0, ARRIVAL_TRACE_LONG_OPT},
+	{"warmup", required_argument, 0, WARMUP_LONG_OPT},
+	{"interval", required_argument, 0, INTERVAL_LONG_OPT},
+	{"slo", required_argument, 0, SLO_LONG_OPT},
+	{"window", required_argument, 0, WINDOW_LONG_OPT},
+	{"per-cpu", no_argument, 0, PER_CPU_LONG_OPT},
+	{"per-msg", no_argument, 0, PER_MSG_LONG_OPT},
+	{"json", no_argument, 0, JSON_LONG_OPT},
 	{"help", no_argument, 0, HELP_LONG_OPT},
 	{0, 0, 0, 0}
 };
@@ -205,14 +541,98 @@ static void print_usage(void)
 		"\t-a (--auto): grow thread count until latencies hurt (def: off)\n"
 		"\t-p (--pipe): transfer size bytes to simulate a pipe test (def: 0)\n"
 		"\t-R (--rps): requests per second mode (count, def: 0)\n"
+		"\t-A (--arrival): rps arrivals, batch, constant or poisson (def: batch)\n"
+		"\t--arrival-trace: rps arrivals from a file of gaps, one usec value per line\n"
+		"\t-w (--wakeup): futex, eventfd, pipe, socket or epoll (def: futex)\n"
+		"\t-k (--think): cputime kernel, spin, alu, fp, cache or stream (def: spin)\n"
+		"\t--footprint: KB per worker for -k cache/stream (def: 256 / 65536)\n"
+		"\t--procs: run each message thread and its workers as a process\n"
+		"\t--cgroup: with --procs, put message thread N in cgroup v2 <name>/msgN\n"
+		"\t--cgroup-set: file=val[,val...] to write in each msgN, values round robin\n"
+		"\t--hist-out: save the raw latency histograms to this file\n"
+		"\t--hist-merge: add up the --hist-out files given as arguments and report\n"
+		"\t--cache-sweep: min:max KB, -l working set doubling each runtime step\n"
+		"\t--locality: also show latencies by waker/wakee and before/after sleep cpu distance\n"
+		"\t--warmup: seconds to run before recording latencies (def: 0)\n"
+		"\t--interval: print p50/p95/p99/max every this many seconds (def: off)\n"
+		"\t--slo: find the highest rps with p99 under this many usec (def: off)\n"
+		"\t--window: seconds to measure each --slo rate for (def: 2)\n"
 		"\t-l (--cachetest): cache test value (count, def: 0)\n"
+		"\t-C (--clock): latency clock, raw or tsc (def: raw)\n"
+		"\t-P (--placement): pin workers relative to their message thread,\n"
+		"\t\tcomma list of smt,llc,xllc,xnuma or all (def: none)\n"
+		"\t--per-cpu: also show latencies by the cpu they were measured on\n"
+		"\t--per-msg: also show latencies by message thread\n"
+		"\t--json: print the final percentile tables as json on stdout\n"
 	       );
 	exit(1);
 }
 
+static void read_arrival_trace(char *path)
+{
+	FILE *f;
+	double gap;
+	int alloced = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror("arrival trace");
+		exit(1);
+	}
+	while (fscanf(f, "%lf", &gap) == 1) {
+		if (nr_arrival_trace == alloced) {
+			alloced = alloced ? alloced * 2 : 1024;
+			arrival_trace = realloc(arrival_trace,
+						alloced * sizeof(*arrival_trace));
+			if (!arrival_trace) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		arrival_trace[nr_arrival_trace++] = gap > 0 ? gap * 1000 : 0;
+	}
+	fclose(f);
+	if (!nr_arrival_trace) {
+		fprintf(stderr, "no arrivals in %s\n", path);
+		exit(1);
+	}
+}
+
+/* fill placements[] from a list like smt,xnuma */
+static void parse_placement(char *arg)
+{
+	char *tok;
+	char *save = NULL;
+	int i, j;
+
+	nr_placements = 0;
+	for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "all")) {
+			nr_placements = 0;
+			for (i = PLACE_SMT; i < PLACE_NR; i++)
+				placements[nr_placements++] = i;
+			break;
+		}
+		for (i = PLACE_SMT; i < PLACE_NR; i++) {
+			if (!strcmp(tok, placement_names[i]))
+				break;
+		}
+		if (i == PLACE_NR) {
+			fprintf(stderr, "unknown placement %s\n", tok);
+			print_usage();
+		}
+		for (j = 0; j < nr_placements; j++) {
+			if (placements[j] == i)
+				break;
+		}
+		if (j == nr_placements)
+			placements[nr_placements++] = i;
+	}
+}
+
 static void parse_options(int ac, char **av)
 {
-	int c;
+	int c, i;
 	int found_sleeptime = -1;
 	int found_cputime = -1;
 
@@ -266,6 +686,116 @@ static void parse_options(int ac, char **av)
 		case 'R':
 			requests_per_sec = atoi(optarg);
 			break;
+		case 'C':
+			if (!strcmp(optarg, "tsc")) {
+				use_tsc = 1;
+			} else if (!strcmp(optarg, "raw")) {
+				use_tsc = 0;
+			} else {
+				fprintf(stderr, "unknown clock %s\n", optarg);
+				print_usage();
+			}
+			break;
+		case 'P':
+			parse_placement(optarg);
+			break;
+		case 'A':
+			if (!strcmp(optarg, "batch")) {
+				arrival = ARRIVAL_BATCH;
+			} else if (!strcmp(optarg, "constant")) {
+				arrival = ARRIVAL_CONSTANT;
+			} else if (!strcmp(optarg, "poisson")) {
+				arrival = ARRIVAL_POISSON;
+			} else {
+				fprintf(stderr, "unknown arrival %s\n", optarg);
+				print_usage();
+			}
+			break;
+		case 'w':
+			for (i = 0; i < WAKE_NR; i++) {
+				if (!strcmp(optarg, wakeup_names[i]))
+					break;
+			}
+			if (i == WAKE_NR) {
+				fprintf(stderr, "unknown wakeup %s\n", optarg);
+				print_usage();
+			}
+			wakeup = i;
+			break;
+		case 'k':
+			for (i = 0; i < THINK_NR; i++) {
+				if (!strcmp(optarg, think_names[i]))
+					break;
+			}
+			if (i == THINK_NR) {
+				fprintf(stderr, "unknown think kernel %s\n", optarg);
+				print_usage();
+			}
+			think = i;
+			break;
+		case FOOTPRINT_LONG_OPT:
+			think_kb = atol(optarg);
+			break;
+		case PROCS_LONG_OPT:
+			procs = 1;
+			break;
+		case CGROUP_LONG_OPT:
+			cgroup_name = optarg;
+			break;
+		case HIST_OUT_LONG_OPT:
+			hist_out = optarg;
+			break;
+		case HIST_MERGE_LONG_OPT:
+			hist_merge = 1;
+			break;
+		case CACHE_SWEEP_LONG_OPT:
+			if (sscanf(optarg, "%lu:%lu", &sweep_min_kb, &sweep_max_kb) != 2 ||
+			    !sweep_min_kb || sweep_max_kb < sweep_min_kb) {
+				fprintf(stderr, "--cache-sweep wants min:max KB\n");
+				exit(1);
+			}
+			if (sweep_max_kb > BUFFER_LENGTH / 1024 * sizeof(double))
+				sweep_max_kb = BUFFER_LENGTH / 1024 * sizeof(double);
+			sweep_kb = sweep_min_kb;
+			cache_test = sweep_kb * 1024 / sizeof(double);
+			break;
+		case CGROUP_SET_LONG_OPT:
+			if (nr_cgroup_sets == CGROUP_SET_MAX || !strchr(optarg, '=')) {
+				fprintf(stderr, "bad or too many --cgroup-set %s\n", optarg);
+				exit(1);
+			}
+			cgroup_sets[nr_cgroup_sets++] = optarg;
+			break;
+		case ARRIVAL_TRACE_LONG_OPT:
+			read_arrival_trace(optarg);
+			arrival = ARRIVAL_TRACE;
+			break;
+		case WARMUP_LONG_OPT:
+			warmup = atoi(optarg);
+			break;
+		case INTERVAL_LONG_OPT:
+			interval = atoi(optarg);
+			break;
+		case SLO_LONG_OPT:
+			slo_p99 = atof(optarg);
+			break;
+		case WINDOW_LONG_OPT:
+			slo_window = atoi(optarg);
+			if (slo_window < 1)
+				slo_window = 1;
+			break;
+		case PER_CPU_LONG_OPT:
+			per_cpu_stats = 1;
+			break;
+		case PER_MSG_LONG_OPT:
+			per_msg_stats = 1;
+			break;
+		case LOCALITY_LONG_OPT:
+			locality = 1;
+			break;
+		case JSON_LONG_OPT:
+			json_output = 1;
+			break;
 		case '?':
 		case HELP_LONG_OPT:
 			print_usage();
@@ -284,7 +814,28 @@ static void parse_options(int ac, char **av)
 	if (found_cputime >= 0)
 		cputime = found_cputime;
 
-	if (optind < ac) {
+	/* these all need to see every thread from main */
+	if (procs && (autobench || slo_p99 > 0 || interval > 0 || cache_test)) {
+		fprintf(stderr, "--procs can't be used with -a, --slo, --interval or -l\n");
+		exit(1);
+	}
+	if ((cgroup_name || nr_cgroup_sets) && !procs) {
+		fprintf(stderr, "--cgroup needs --procs\n");
+		exit(1);
+	}
+	if (sweep_min_kb && (requests_per_sec || autobench || slo_p99 > 0)) {
+		fprintf(stderr, "--cache-sweep can't be used with -R, -a or --slo\n");
+		exit(1);
+	}
+	if (nr_cgroup_sets && !cgroup_name) {
+		fprintf(stderr, "--cgroup-set needs --cgroup\n");
+		exit(1);
+	}
+
+	if (hist_merge) {
+		hist_files = av + optind;
+		nr_hist_files = ac - optind;
+	} else if (optind < ac) {
 		fprintf(stderr, "Error Extra arguments '%s'\n", av[optind]);
 		exit(1);
 	}
@@ -326,6 +877,84 @@ unsigned long long tvdelta(struct timeval *start, struct timeval *stop)
 	return (usecs);
 }
 
+static unsigned long long raw_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+static inline unsigned long long rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
+}
+
+/* the tsc is only usable as a clock if it ticks at a fixed rate */
+static int tsc_is_invariant(void)
+{
+	char line[4096];
+	FILE *f;
+	int found = 0;
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "flags", 5)) {
+			found = strstr(line, " constant_tsc") &&
+				strstr(line, " nonstop_tsc");
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+/*
+ * time 100ms of CLOCK_MONOTONIC_RAW against the tsc to find the
+ * nsec per tick
+ */
+static void calibrate_tsc(void)
+{
+	unsigned long long t0, t1, c0, c1;
+
+	if (!tsc_is_invariant()) {
+		fprintf(stderr, "tsc is not invariant, using CLOCK_MONOTONIC_RAW\n");
+		use_tsc = 0;
+		return;
+	}
+	t0 = raw_nsec();
+	c0 = rdtsc();
+	usleep(100000);
+	t1 = raw_nsec();
+	c1 = rdtsc();
+	tsc_mult = ((t1 - t0) << 32) / (c1 - c0);
+	fprintf(stderr, "tsc calibrated at %.3f MHz\n",
+		(double)(c1 - c0) * 1000 / (t1 - t0));
+}
+#else
+static void calibrate_tsc(void)
+{
+	fprintf(stderr, "no tsc clock on this arch, using CLOCK_MONOTONIC_RAW\n");
+	use_tsc = 0;
+}
+#endif
+
+/* timestamps for latency measurement, in nsec */
+static unsigned long long nsec_now(void)
+{
+#if defined(__x86_64__)
+	if (use_tsc)
+		return ((unsigned __int128)rdtsc() * tsc_mult) >> 32;
+#endif
+	return raw_nsec();
+}
+
 /* mr axboe's magic latency histogram */
 static unsigned int plat_val_to_idx(unsigned int val)
 {
@@ -391,10 +1020,11 @@ static unsigned int plat_idx_to_val(unsigned int idx)
 }
 
 
-static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
-				     unsigned int **output)
+static unsigned int calc_wide_percentiles(unsigned long long *io_u_plat,
+					  unsigned long long nr,
+					  unsigned int **output)
 {
-	unsigned long sum = 0;
+	unsigned long long sum = 0;
 	unsigned int len, i, j = 0;
 	unsigned int oval_len = 0;
 	unsigned int *ovals = NULL;
@@ -432,38 +1062,168 @@ static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
 	return len;
 }
 
-static void calc_p99(struct stats *s, int *p95, int *p99)
+static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
+				     unsigned int **output)
+{
+	unsigned long long *wide;
+	unsigned int len;
+	int i;
+
+	wide = malloc(PLAT_NR * sizeof(*wide));
+	if (!wide) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < PLAT_NR; i++)
+		wide[i] = io_u_plat[i];
+	len = calc_wide_percentiles(wide, nr, output);
+	free(wide);
+	return len;
+}
+
+/* p95 and p99 come back in usec */
+static void calc_p99(struct stats *s, double *p95, double *p99)
 {
 	unsigned int *ovals = NULL;
 	int len;
 
 	len = calc_percentiles(s->plat, s->nr_samples, &ovals);
 	if (len && len > PLIST_P99)
-		*p99 = ovals[PLIST_P99];
+		*p99 = ovals[PLIST_P99] / 1000.0;
 	if (len && len > PLIST_P99)
-		*p95 = ovals[PLIST_P95];
+		*p95 = ovals[PLIST_P95] / 1000.0;
 	if (ovals)
 		free(ovals);
 }
 
-static void show_latencies(struct stats *s)
+static void print_latencies(unsigned int *ovals, unsigned int len,
+			    unsigned int min, unsigned int max)
 {
-	unsigned int *ovals = NULL;
-	unsigned int len, i;
+	unsigned int i;
 
-	len = calc_percentiles(s->plat, s->nr_samples, &ovals);
 	if (len) {
 		fprintf(stderr, "Latency percentiles (usec)\n");
 		for (i = 0; i < len; i++)
-			fprintf(stderr, "\t%s%2.4fth: %u\n",
+			fprintf(stderr, "\t%s%2.4fth: %.3f\n",
 				i == PLIST_P99 ? "*" : "",
-				plist[i], ovals[i]);
+				plist[i], ovals[i] / 1000.0);
 	}
 
 	if (ovals)
 		free(ovals);
 
-	fprintf(stderr, "\tmin=%u, max=%u\n", s->min, s->max);
+	fprintf(stderr, "\tmin=%.3f, max=%.3f\n", min / 1000.0, max / 1000.0);
+}
+
+static void show_latencies(struct stats *s)
+{
+	unsigned int *ovals = NULL;
+	unsigned int len;
+
+	len = calc_percentiles(s->plat, s->nr_samples, &ovals);
+	print_latencies(ovals, len, s->min, s->max);
+}
+
+static void show_wide_latencies(struct wide_stats *s)
+{
+	unsigned int *ovals = NULL;
+	unsigned int len;
+
+	len = calc_wide_percentiles(s->plat, s->nr_samples, &ovals);
+	print_latencies(ovals, len, s->min, s->max);
+}
+
+/* one json object with the same numbers show_latencies() prints */
+static void print_json_stats(unsigned int *ovals, unsigned int len,
+			     unsigned long long nr_samples,
+			     unsigned int min, unsigned int max)
+{
+	unsigned int i;
+
+	printf("{\"samples\": %llu, \"min_usec\": %.3f, \"max_usec\": %.3f, \"percentiles_usec\": {",
+	       nr_samples, min / 1000.0, max / 1000.0);
+	for (i = 0; i < len; i++)
+		printf("%s\"%g\": %.3f", i ? ", " : "", plist[i], ovals[i] / 1000.0);
+	printf("}}");
+
+	if (ovals)
+		free(ovals);
+}
+
+static void show_json_stats(struct stats *s)
+{
+	unsigned int *ovals = NULL;
+	unsigned int len;
+
+	len = calc_percentiles(s->plat, s->nr_samples, &ovals);
+	print_json_stats(ovals, len, s->nr_samples, s->min, s->max);
+}
+
+static void show_wide_json_stats(struct wide_stats *s)
+{
+	unsigned int *ovals = NULL;
+	unsigned int len;
+
+	len = calc_wide_percentiles(s->plat, s->nr_samples, &ovals);
+	print_json_stats(ovals, len, s->nr_samples, s->min, s->max);
+}
+
+static void widen_stats(struct wide_stats *d, struct stats *s)
+{
+	int i;
+
+	for (i = 0; i < PLAT_NR; i++)
+		d->plat[i] = s->plat[i];
+	d->nr_samples = s->nr_samples;
+	d->max = s->max;
+	d->min = s->min;
+}
+
+static void write_hists(char *path, char (*names)[HIST_NAME_LEN],
+			struct wide_stats *hists, int nr)
+{
+	struct hist_header hdr;
+	struct hist_record rec;
+	uint64_t pair[2];
+	FILE *f;
+	int ret = 0;
+	int i, j;
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HIST_MAGIC;
+	hdr.version = HIST_VERSION;
+	hdr.plat_bits = PLAT_BITS;
+	hdr.plat_groups = PLAT_GROUP_NR;
+	hdr.nr_hists = nr;
+	ret |= fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+
+	for (i = 0; i < nr; i++) {
+		memset(&rec, 0, sizeof(rec));
+		snprintf(rec.name, sizeof(rec.name), "%s", names[i]);
+		rec.nr_samples = hists[i].nr_samples;
+		rec.min = hists[i].min;
+		rec.max = hists[i].max;
+		for (j = 0; j < PLAT_NR; j++)
+			rec.nr_buckets += hists[i].plat[j] != 0;
+		ret |= fwrite(&rec, sizeof(rec), 1, f) != 1;
+
+		for (j = 0; j < PLAT_NR; j++) {
+			if (!hists[i].plat[j])
+				continue;
+			pair[0] = j;
+			pair[1] = hists[i].plat[j];
+			ret |= fwrite(pair, sizeof(pair), 1, f) != 1;
+		}
+	}
+	if (fclose(f) || ret) {
+		fprintf(stderr, "unable to write %s\n", path);
+		exit(1);
+	}
 }
 
 /* fold latency info from s into d */
@@ -479,28 +1239,51 @@ void combine_stats(struct stats *d, struct stats *s)
 		d->min = s->min;
 }
 
-/* record a latency result into the histogram */
-static void add_lat(struct stats *s, unsigned int us)
+/* record a latency result (nsec) into the histogram */
+static void add_lat(struct stats *s, unsigned long long delta)
 {
+	unsigned int ns = delta > UINT_MAX ? UINT_MAX : delta;
 	int lat_index = 0;
 
-	if (us > s->max)
-		s->max = us;
-	if (us < s->min)
-		s->min = us;
+	if (ns > s->max)
+		s->max = ns;
+	if (ns < s->min)
+		s->min = ns;
 
-	lat_index = plat_val_to_idx(us);
+	lat_index = plat_val_to_idx(ns);
 	__sync_fetch_and_add(&s->plat[lat_index], 1);
 	__sync_fetch_and_add(&s->nr_samples, 1);
 }
 
+/*
+ * --per-cpu histograms, indexed by the cpu the latency was measured on.
+ * Workers of every message thread share these, add_lat is atomic enough
+ */
+static struct stats *cpu_stats;
+static int nr_cpu_stats;
+
+static void record_lat(struct stats *s, unsigned long long delta)
+{
+	int cpu;
+
+	if (warming)
+		return;
+	add_lat(s, delta);
+	if (cpu_stats) {
+		cpu = sched_getcpu();
+		if (cpu >= 0 && cpu < nr_cpu_stats)
+			add_lat(&cpu_stats[cpu], delta);
+	}
+}
+
 struct request {
-	struct timeval start_time;
+	unsigned long long start_time;	/* nsec_now() when it was queued */
+	unsigned long long intended_time;	/* when it should have been */
 	struct request *next;
 };
 
 /*
- * every thread has one of these, it comes out to about 19K thanks to the
+ * every thread has one of these, it comes out to about 26K thanks to the
  * giant stats struct
  */
 struct thread_data {
@@ -513,30 +1296,107 @@ struct thread_data {
 	/* ->request is all of our pending request */
 	struct request *request;
 
+	/*
+	 * -R request pool.  The worker gives requests back on ->free_requests
+	 * and the rps thread splices that into ->free_cache, which only it
+	 * touches, so neither side ever needs the heap
+	 */
+	struct request *request_pool;
+	struct request *free_requests;
+	struct request *free_cache;
+
 	/* our parent thread and messaging partner */
 	struct thread_data *msg_thread;
 
 	/*
-	 * the msg thread stuffs gtod in here before waking us, so we can
-	 * measure scheduler latency
+	 * message threads only, so main can read live worker stats and add
+	 * workers between autobench steps
 	 */
-	struct timeval wake_time;
+	struct thread_data **workers;
+	int nr_workers;
 
-	/* keep the futex and the wake_time in the same cacheline */
-	int futex;
+	/*
+	 * the msg thread stuffs nsec_now() in here before waking us, so we can
+	 * measure scheduler latency.  The futex and the wake_time get a
+	 * cacheline to themselves so the waker only bounces this one line
+	 */
+	struct {
+		unsigned long long wake_time;
+		/* --locality, sched_getcpu() of whoever set wake_time */
+		int waker_cpu;
+		int futex;
+		/* -w channel, [0] is read and [1] written, -1 for futex */
+		int wake_fd[2];
+		int epoll_fd;
+	} __attribute__((aligned(CACHELINE_SIZE)));
 
 	/* mr axboe's magic latency histogram */
-	struct stats stats;
+	struct stats stats __attribute__((aligned(CACHELINE_SIZE)));
+	/* -R latency from the intended arrival rather than the enqueue */
+	struct stats intended_stats;
+	/* largest latency since main last took it for an -i/--slo window */
+	unsigned int window_max;
 	double loops_per_sec;
 
-	char pipe_page[PIPE_TRANSFER_BUFFER];
+	/* -p bytes, only allocated for workers in pipe mode */
+	char *pipe_page;
 
-	double buffer[BUFFER_LENGTH];
+	/* -l doubles, only allocated for message threads in cache test mode */
+	double *buffer;
 	volatile double sum;
-};
 
-/* we're so fancy we make our own futex wrappers */
-#define FUTEX_BLOCKED 0
+	/* --locality, our cpu when we blocked and when we woke up */
+	int block_cpu;
+	int woke_cpu;
+	int slept;
+
+	/* --cache-sweep counter group, and its counts for the last step */
+	int sweep_fd;
+	unsigned long long sweep_last[SWEEP_EVENTS];
+	unsigned long long sweep_step[SWEEP_EVENTS];
+
+	/* -k cache/stream working set, and where the last think stopped */
+	unsigned long *think_buf;
+	unsigned long think_nr;
+	unsigned long think_pos;
+
+	/* --procs, the process running this message thread */
+	pid_t pid;
+
+	/* --placement, message threads only */
+	int placement;
+	int msg_cpu;
+	cpu_set_t worker_cpus;
+};
+
+/*
+ * thread_data arrays are cacheline aligned for the futex block, and
+ * come back zeroed like calloc
+ */
+static struct thread_data *alloc_thread_data(int nr)
+{
+	void *p;
+
+	if (posix_memalign(&p, CACHELINE_SIZE, nr * sizeof(struct thread_data)))
+		return NULL;
+	memset(p, 0, nr * sizeof(struct thread_data));
+	return p;
+}
+
+/* --procs puts message thread_data and --per-cpu stats where children can write */
+static void *alloc_shared(size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		 -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	return p;
+}
+
+/* we're so fancy we make our own futex wrappers */
+#define FUTEX_BLOCKED 0
 #define FUTEX_RUNNING 1
 
 static int futex(int *uaddr, int futex_op, int val,
@@ -591,6 +1451,114 @@ static int fwait(int *futexp, struct timespec *timeout)
 	return 0;
 }
 
+/* open the -w channel of a thread, before it starts */
+static int setup_wakeup(struct thread_data *td)
+{
+	struct epoll_event ev;
+
+	td->wake_fd[0] = td->wake_fd[1] = td->epoll_fd = -1;
+	switch (wakeup) {
+	case WAKE_EVENTFD:
+	case WAKE_EPOLL:
+		td->wake_fd[0] = eventfd(0, EFD_CLOEXEC);
+		if (td->wake_fd[0] < 0)
+			return -errno;
+		td->wake_fd[1] = td->wake_fd[0];
+		break;
+	case WAKE_PIPE:
+		if (pipe2(td->wake_fd, O_CLOEXEC))
+			return -errno;
+		break;
+	case WAKE_SOCKET:
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, td->wake_fd))
+			return -errno;
+		break;
+	default:
+		return 0;
+	}
+
+	if (wakeup == WAKE_EPOLL) {
+		td->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (td->epoll_fd < 0)
+			return -errno;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = td;
+		if (epoll_ctl(td->epoll_fd, EPOLL_CTL_ADD, td->wake_fd[0], &ev))
+			return -errno;
+	}
+	return 0;
+}
+
+static void cleanup_wakeup(struct thread_data *td)
+{
+	if (td->epoll_fd >= 0)
+		close(td->epoll_fd);
+	if (td->wake_fd[1] >= 0 && td->wake_fd[1] != td->wake_fd[0])
+		close(td->wake_fd[1]);
+	if (td->wake_fd[0] >= 0)
+		close(td->wake_fd[0]);
+	td->wake_fd[0] = td->wake_fd[1] = td->epoll_fd = -1;
+}
+
+/*
+ * fpost() over the -w transport.  Only the poster that wins the
+ * BLOCKED->RUNNING cmpxchg sends a token, just like only it would
+ * FUTEX_WAKE
+ */
+static void post_wake(struct thread_data *td)
+{
+	unsigned long long one = 1;
+	ssize_t ret;
+
+	if (wakeup == WAKE_FUTEX) {
+		fpost(&td->futex);
+		return;
+	}
+	if (!__sync_bool_compare_and_swap(&td->futex, FUTEX_BLOCKED,
+					  FUTEX_RUNNING))
+		return;
+
+	/* eventfd takes a whole counter, the byte streams a single byte */
+	if (wakeup == WAKE_EVENTFD || wakeup == WAKE_EPOLL)
+		ret = write(td->wake_fd[1], &one, sizeof(one));
+	else
+		ret = write(td->wake_fd[1], &one, 1);
+	if (ret < 0) {
+		perror("wakeup write");
+		exit(1);
+	}
+}
+
+/*
+ * fwait() over the -w transport.  A token left behind by a post that
+ * beat us here just costs one more trip around the loop
+ */
+static void wait_wake(struct thread_data *td)
+{
+	unsigned long long buf[8];
+	struct epoll_event ev;
+	ssize_t ret;
+
+	if (wakeup == WAKE_FUTEX) {
+		fwait(&td->futex, NULL);
+		return;
+	}
+	while (!__sync_bool_compare_and_swap(&td->futex, FUTEX_RUNNING,
+					     FUTEX_BLOCKED)) {
+		if (wakeup == WAKE_EPOLL &&
+		    epoll_wait(td->epoll_fd, &ev, 1, -1) < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		ret = read(td->wake_fd[0], buf, sizeof(buf));
+		if (ret < 0 && errno != EINTR) {
+			perror("wakeup read");
+			exit(1);
+		}
+	}
+}
+
 /*
  * cmpxchg based list prepend
  */
@@ -670,20 +1638,83 @@ static struct request *request_splice(struct thread_data *head)
 	return reverse;
 }
 
-static struct request *allocate_request(void)
+/*
+ * requests we had to malloc because a worker's pool was empty.  Points
+ * into shared memory with --procs so the children's misses add up here
+ */
+static unsigned long local_pool_misses = 0;
+static unsigned long *request_pool_misses = &local_pool_misses;
+
+static int setup_request_pool(struct thread_data *td)
 {
-	struct request *ret = malloc(sizeof(*ret));
+	int i;
 
-	if (!ret) {
-		perror("malloc");
-		exit(1);
+	td->request_pool = calloc(REQUEST_POOL_SIZE, sizeof(struct request));
+	if (!td->request_pool)
+		return -ENOMEM;
+	for (i = 0; i < REQUEST_POOL_SIZE - 1; i++)
+		td->request_pool[i].next = td->request_pool + i + 1;
+	td->free_cache = td->request_pool;
+	td->free_requests = NULL;
+	return 0;
+}
+
+/*
+ * called by the rps thread only.  When its private cache runs dry it
+ * takes everything the worker has given back in one xchg
+ */
+static struct request *allocate_request(struct thread_data *worker)
+{
+	struct request *ret;
+	struct request *old;
+
+	if (!worker->free_cache) {
+		while (1) {
+			old = worker->free_requests;
+			ret = __sync_val_compare_and_swap(&worker->free_requests, old, NULL);
+			if (ret == old)
+				break;
+		}
+		worker->free_cache = ret;
+	}
+
+	ret = worker->free_cache;
+	if (ret) {
+		worker->free_cache = ret->next;
+	} else {
+		ret = malloc(sizeof(*ret));
+		if (!ret) {
+			perror("malloc");
+			exit(1);
+		}
+		__sync_fetch_and_add(request_pool_misses, 1);
 	}
 
-	gettimeofday(&ret->start_time, NULL);
+	ret->start_time = nsec_now();
+	ret->intended_time = ret->start_time;
 	ret->next = NULL;
 	return ret;
 }
 
+/* called by the worker, pooled requests go back with a cmpxchg prepend */
+static void free_request(struct thread_data *td, struct request *req)
+{
+	struct request *old;
+	struct request *ret;
+
+	if (req < td->request_pool || req >= td->request_pool + REQUEST_POOL_SIZE) {
+		free(req);
+		return;
+	}
+	while (1) {
+		old = td->free_requests;
+		req->next = old;
+		ret = __sync_val_compare_and_swap(&td->free_requests, old, req);
+		if (ret == old)
+			break;
+	}
+}
+
 
 /*
  * Wake everyone currently waiting on the message list, filling in their
@@ -701,38 +1732,44 @@ static void xlist_wake_all(struct thread_data *td)
 {
 	struct thread_data *list;
 	struct thread_data *next;
-	struct timeval now;
-	struct timeval start, stop;
+	unsigned long long now;
+	unsigned long long start;
+	int cpu;
 
 	list = xlist_splice(td);
-	gettimeofday(&now, NULL);
+	now = nsec_now();
+	cpu = locality ? sched_getcpu() : -1;
 	while (list) {
 		next = list->next;
 		list->next = NULL;
 
 		if (cache_test) {
-			gettimeofday(&start, NULL);
+			start = nsec_now();
 #ifndef NO_PERF_COUNTERS
-			reset_counters(td->index);
-			start_counters(td->index);
+			if (!sweep_kb) {
+				reset_counters(td->index);
+				start_counters(td->index);
+			}
 #endif
 			for(int i=0; i<cache_test; i+=129)
 				td->sum += td->buffer[i];
 #ifndef NO_PERF_COUNTERS
-			stop_counters(td->index);
-			read_counters(td->index);
+			if (!sweep_kb) {
+				stop_counters(td->index);
+				read_counters(td->index);
+			}
 #endif
-			gettimeofday(&stop, NULL);
-			time_diff[td->index] += tvdelta(&start, &stop);
+			time_diff[td->index] += nsec_now() - start;
 		}
 
 		if (pipe_test) {
 			memset(list->pipe_page, 1, pipe_test);
-			gettimeofday(&list->wake_time, NULL);
+			list->wake_time = nsec_now();
 		} else {
-			memcpy(&list->wake_time, &now, sizeof(now));
+			list->wake_time = now;
 		}
-		fpost(&list->futex);
+		list->waker_cpu = cpu;
+		post_wake(list);
 		list = next;
 	}
 }
@@ -743,9 +1780,11 @@ static void xlist_wake_all(struct thread_data *td)
  * it, but that's good enough.  We gtod after waking and use that to
  * record scheduler latency.
  */
+static void record_locality(struct thread_data *td, unsigned long long delta);
+static void record_window_max(struct thread_data *td, unsigned long long delta);
+
 static struct request *msg_and_wait(struct thread_data *td)
 {
-	struct timeval now;
 	unsigned long long delta;
 	struct request *req;
 
@@ -763,12 +1802,19 @@ static struct request *msg_and_wait(struct thread_data *td)
 
 	/* set ourselves to blocked */
 	td->futex = FUTEX_BLOCKED;
-	gettimeofday(&td->wake_time, NULL);
+	td->wake_time = nsec_now();
 
 	/* add us to the list */
 	if (requests_per_sec) {
 		req = request_splice(td);
 		if (req) {
+			/*
+			 * these are either what our last wakeup was for, or
+			 * they came in while we ran and we never moved
+			 */
+			if (locality && !td->slept)
+				td->block_cpu = td->woke_cpu = sched_getcpu();
+			td->slept = 0;
 			td->futex = FUTEX_RUNNING;
 			return req;
 		}
@@ -776,7 +1822,9 @@ static struct request *msg_and_wait(struct thread_data *td)
 		xlist_add(td->msg_thread, td);
 	}
 
-	fpost(&td->msg_thread->futex);
+	if (locality)
+		td->block_cpu = sched_getcpu();
+	post_wake(td->msg_thread);
 
 	/*
 	 * don't wait if the main threads are shutting down,
@@ -786,14 +1834,20 @@ static struct request *msg_and_wait(struct thread_data *td)
 	 */
 	if (!stopping) {
 		/* if he hasn't already woken us up, wait */
-		fwait(&td->futex, NULL);
+		wait_wake(td);
+	}
+	if (locality) {
+		td->woke_cpu = sched_getcpu();
+		td->slept = 1;
 	}
 
 	if (!requests_per_sec) {
-		gettimeofday(&now, NULL);
-		delta = tvdelta(&td->wake_time, &now);
-		if (delta > 0)
-			add_lat(&td->stats, delta);
+		delta = nsec_now() - td->wake_time;
+		if ((long long)delta > 0) {
+			record_lat(&td->stats, delta);
+			record_window_max(td, delta);
+			record_locality(td, delta);
+		}
 	}
 	return NULL;
 }
@@ -810,13 +1864,6 @@ static void run_msg_thread(struct thread_data *td)
 	int max_jitter = sleeptime / 4;
 	int jitter = 0;
 
-	if (cache_test) {
-		for(int i=0; i<cache_test; i++)
-			td->buffer[i] = rand();
-#ifndef NO_PERF_COUNTERS
-		setup_counters(td->index);
-#endif
-	}
 	while (1) {
 		td->futex = FUTEX_BLOCKED;
 		xlist_wake_all(td);
@@ -825,7 +1872,7 @@ static void run_msg_thread(struct thread_data *td)
 			xlist_wake_all(td);
 			break;
 		}
-		fwait(&td->futex, NULL);
+		wait_wake(td);
 
 		/*
 		 * messages shouldn't be instant, sleep a little to make them
@@ -844,7 +1891,7 @@ static void run_msg_thread(struct thread_data *td)
  * for posting by the worker threads, replying to their messages after
  * a delay of 'sleeptime' + some jitter.
  */
-static void run_rps_thread(struct thread_data *worker_threads_mem)
+static void run_rps_thread(struct thread_data **workers)
 {
 	/* number to wake at a time */
 	int nr_to_wake = worker_threads * 2 / 3;
@@ -853,8 +1900,8 @@ static void run_rps_thread(struct thread_data *worker_threads_mem)
 	/* list to record tasks waiting for work */
 	/* how many times do we need to batch wakeups per second */
 	int wakeups_required;
-	/* start and end of the thread run */
-	struct timeval start;
+	/* start of each wakeup batch */
+	unsigned long long start;
 	struct request *request;
 
 	/* how long do we sleep between wakeup batches */
@@ -863,38 +1910,43 @@ static void run_rps_thread(struct thread_data *worker_threads_mem)
 	unsigned long total_wakes = 0;
 	int left;
 	int cur_tid = 0;
+	int cpu;
 	int i;
 
-	gettimeofday(&start, NULL);
-
-	wakeups_required = (requests_per_sec + nr_to_wake - 1) / nr_to_wake;
-	sleep_time = 1000000 / wakeups_required;
-
 	while (1) {
+		/* --slo changes requests_per_sec under us */
+		wakeups_required = (requests_per_sec + nr_to_wake - 1) / nr_to_wake;
+		if (wakeups_required < 1)
+			wakeups_required = 1;
+		sleep_time = 1000000 / wakeups_required;
+
 		/* start with a sleep to give everyone the chance to get going */
 		usleep(sleep_time);
 
-		gettimeofday(&start, NULL);
+		start = nsec_now();
 		left = nr_to_wake;
+		cpu = locality ? sched_getcpu() : -1;
 
 		for (i = 0; i < nr_to_wake; i++) {
 			struct thread_data *worker;
 			struct request *old;
 
-			worker = worker_threads_mem + cur_tid % worker_threads;
+			worker = workers[cur_tid % worker_threads];
 			cur_tid++;
 
-			request = allocate_request();
+			request = allocate_request(worker);
+			request->intended_time = start;
 			old = request_add(worker, request);
 			total_wakes++;
-			memcpy(&worker->wake_time, &start, sizeof(start));
-			fpost(&worker->futex);
+			worker->wake_time = start;
+			worker->waker_cpu = cpu;
+			post_wake(worker);
 		}
 		total_wake_runs++;
 
 		if (stopping) {
 			for (i = 0; i < worker_threads; i++)
-				fpost(&worker_threads_mem[i].futex);
+				post_wake(workers[i]);
 			break;
 		}
 	}
@@ -908,23 +1960,222 @@ static void run_rps_thread(struct thread_data *worker_threads_mem)
 
 static void usec_spin(unsigned long spin_time)
 {
-	struct timeval now;
-	struct timeval start;
-	unsigned long long delta;
+	unsigned long long start;
+	unsigned long long spin_ns = spin_time * 1000ULL;
 
 	if (spin_time == 0)
 		return;
 
-	gettimeofday(&start, NULL);
+	start = nsec_now();
 	while (1) {
-		gettimeofday(&now, NULL);
-		delta = tvdelta(&start, &now);
-		if (delta > spin_time)
+		if (nsec_now() - start > spin_ns)
 			return;
 		nop;
 	}
 }
 
+/* workers allocate (and fault in) their own -k working set */
+static void setup_think(struct thread_data *td)
+{
+	if (think != THINK_CACHE && think != THINK_STREAM)
+		return;
+	if (!think_kb)
+		think_kb = think == THINK_CACHE ? 256 : 64 * 1024;
+	td->think_nr = think_kb * 1024 / sizeof(unsigned long);
+	if (td->think_nr < 8)
+		td->think_nr = 8;
+	td->think_buf = malloc(td->think_nr * sizeof(unsigned long));
+	if (!td->think_buf) {
+		perror("unable to allocate think working set");
+		exit(1);
+	}
+	memset(td->think_buf, 1, td->think_nr * sizeof(unsigned long));
+	td->think_pos = 0;
+}
+
+/*
+ * run 'loops' iterations of the -k kernel.  The cache and stream kernels
+ * touch one cacheline per loop and pick up where the last call left off
+ */
+static unsigned long think_loops(struct thread_data *td, unsigned long loops)
+{
+	unsigned long x = td->think_pos | 1;
+	unsigned long sum = 0;
+	unsigned long pos;
+	double a[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	unsigned long i;
+	int j;
+
+	switch (think) {
+	case THINK_ALU:
+		for (i = 0; i < loops; i++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+		}
+		td->think_pos = x;
+		return x;
+	case THINK_FP:
+		for (i = 0; i < loops; i++) {
+			for (j = 0; j < 8; j++)
+				a[j] = a[j] * 0.9999999 + 0.0000001;
+		}
+		return a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7];
+	case THINK_CACHE:
+	case THINK_STREAM:
+		pos = td->think_pos;
+		for (i = 0; i < loops; i++) {
+			sum += td->think_buf[pos];
+			if (think == THINK_STREAM)
+				td->think_buf[pos] = sum;
+			pos += CACHELINE_SIZE / sizeof(unsigned long);
+			if (pos >= td->think_nr)
+				pos = 0;
+		}
+		td->think_pos = pos;
+		return sum;
+	default:
+		return 0;
+	}
+}
+
+/* time the -k kernel for at least 50ms to find its loops per usec */
+static void calibrate_think(void)
+{
+	struct thread_data *td;
+	unsigned long long start, delta;
+	unsigned long loops;
+
+	if (think == THINK_SPIN)
+		return;
+	td = calloc(1, sizeof(*td));
+	if (!td) {
+		perror("calloc");
+		exit(1);
+	}
+	setup_think(td);
+	td->sum += think_loops(td, 1024);
+
+	for (loops = 1024; ; loops *= 2) {
+		start = raw_nsec();
+		td->sum += think_loops(td, loops);
+		delta = raw_nsec() - start;
+		if (delta >= 50000000ULL)
+			break;
+	}
+	think_loops_per_usec = (double)loops * 1000 / delta;
+	fprintf(stderr, "think kernel %s: %.2f loops/usec\n",
+		think_names[think], think_loops_per_usec);
+	free(td->think_buf);
+	free(td);
+}
+
+/* burn cputime usecs with the -k kernel */
+static void think_for(struct thread_data *td, unsigned long usecs)
+{
+	if (think == THINK_SPIN) {
+		usec_spin(usecs);
+		return;
+	}
+	if (usecs)
+		td->sum += think_loops(td, usecs * think_loops_per_usec);
+}
+
+/* arrivals sleep most of the way, then spin so timer slack doesn't make them late */
+#define ARRIVAL_SPIN_NS 20000
+
+static void sleep_until(unsigned long long when)
+{
+	unsigned long long now = nsec_now();
+	unsigned long long delta;
+	struct timespec ts;
+
+	if (when > now + ARRIVAL_SPIN_NS) {
+		delta = when - now - ARRIVAL_SPIN_NS;
+		ts.tv_sec = delta / 1000000000ULL;
+		ts.tv_nsec = delta % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+	while (nsec_now() < when)
+		nop;
+}
+
+/*
+ * open loop version of run_rps_thread.  Requests go out one at a time,
+ * round robin over our workers, at the times the arrival process picks.
+ * The schedule never waits for us, so if we fall behind the backlog goes
+ * out back to back and the lateness shows up in the intended latencies
+ */
+static void run_arrival_thread(struct thread_data **workers)
+{
+	unsigned int seed = pthread_self();
+	unsigned long long next;
+	unsigned long long gap_ns;
+	struct thread_data *worker;
+	struct request *request;
+	double u;
+	int trace_pos = 0;
+	int cur_tid = 0;
+	int i;
+
+	next = nsec_now();
+
+	while (!stopping) {
+		/* --slo changes requests_per_sec under us */
+		gap_ns = 1000000000ULL / (requests_per_sec > 0 ? requests_per_sec : 1);
+		switch (arrival) {
+		case ARRIVAL_POISSON:
+			u = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+			next += -log(u) * gap_ns;
+			break;
+		case ARRIVAL_TRACE:
+			next += arrival_trace[trace_pos];
+			trace_pos = (trace_pos + 1) % nr_arrival_trace;
+			break;
+		default:
+			next += gap_ns;
+			break;
+		}
+		sleep_until(next);
+
+		worker = workers[cur_tid % worker_threads];
+		cur_tid++;
+
+		request = allocate_request(worker);
+		request->intended_time = next;
+		request_add(worker, request);
+		worker->wake_time = request->start_time;
+		worker->waker_cpu = locality ? sched_getcpu() : -1;
+		post_wake(worker);
+	}
+
+	for (i = 0; i < worker_threads; i++)
+		post_wake(workers[i]);
+}
+
+/*
+ * autobench parks threads here when a step is up.  index is the worker
+ * index, or -1 for message threads.  Returns 0 when it's time to exit
+ */
+static int phase_park(int index)
+{
+	unsigned long mine;
+	int ret;
+
+	if (!persistent)
+		return 0;
+
+	pthread_mutex_lock(&phase_lock);
+	mine = phase;
+	nr_parked++;
+	pthread_cond_signal(&parked_cond);
+	while (!phase_done && (phase == mine || index >= worker_threads))
+		pthread_cond_wait(&phase_cond, &phase_lock);
+	ret = !phase_done;
+	pthread_mutex_unlock(&phase_lock);
+	return ret;
+}
+
 /*
  * the worker thread is pretty simple, it just does a single spin and
  * then waits on a message from the message thread
@@ -935,123 +2186,882 @@ void *worker_thread(void *arg)
 	struct timeval now;
 	struct timeval start;
 	unsigned long long delta;
+	unsigned long long now_ns;
 	unsigned long loop_count = 0;
 	struct request *req = NULL;
 	double seconds;
 
+	setup_think(td);
+	td->sweep_fd = sweep_kb ? open_sweep_counters() : -1;
+	if (pipe_test) {
+		td->pipe_page = malloc(pipe_test);
+		if (!td->pipe_page) {
+			perror("unable to allocate pipe page");
+			exit(1);
+		}
+	}
+
 	gettimeofday(&start, NULL);
 	while(1) {
-		if (stopping)
-			break;
+		if (stopping) {
+			gettimeofday(&now, NULL);
+			delta = tvdelta(&start, &now);
+
+			seconds = (double)delta/1000000;
+			td->loops_per_sec = (double)loop_count / seconds;
+
+			/* whatever was in flight doesn't belong to the next step */
+			while (req) {
+				struct request *tmp = req->next;
+
+				free_request(td, req);
+				req = tmp;
+			}
+			read_sweep_counters(td->sweep_fd, td->sweep_last,
+					    td->sweep_step);
+			if (!phase_park(td->index))
+				break;
+			loop_count = 0;
+			gettimeofday(&start, NULL);
+			continue;
+		}
 
 		if (requests_per_sec) {
 			while (req) {
 				struct request *tmp = req->next;
 
-				usec_spin(cputime);
+				think_for(td, cputime);
+
+				now_ns = nsec_now();
+				delta = now_ns - req->start_time;
+				if ((long long)delta > (long long)(cputime * 1000))
+					delta -= cputime * 1000;
+				else
+					delta = 1;
+				record_lat(&td->stats, delta);
+				record_window_max(td, delta);
+				record_locality(td, delta);
 
-				gettimeofday(&now, NULL);
-				delta = tvdelta(&req->start_time, &now);
-				if (delta > cputime)
-					delta -= cputime;
+				delta = now_ns - req->intended_time;
+				if ((long long)delta > (long long)(cputime * 1000))
+					delta -= cputime * 1000;
 				else
 					delta = 1;
-				add_lat(&td->stats, delta);
+				if (!warming)
+					add_lat(&td->intended_stats, delta);
 
-				free(req);
+				free_request(td, req);
 				req = tmp;
 				loop_count++;
 			}
 		} else {
-			usec_spin(cputime);
+			think_for(td, cputime);
 			loop_count++;
 		}
 
 		req = msg_and_wait(td);
 	}
-	gettimeofday(&now, NULL);
-	delta = tvdelta(&start, &now);
-
-	seconds = (double)delta/1000000;
-	td->loops_per_sec = (double)loop_count / seconds;
+	if (td->sweep_fd >= 0)
+		close(td->sweep_fd);
+	free(td->pipe_page);
+	td->pipe_page = NULL;
+	free(td->think_buf);
+	td->think_buf = NULL;
 	return NULL;
 }
 
 /*
- * the message thread starts his own gaggle of workers and then sits around
- * replying when they post him.  He collects latency stats as all the threads
- * exit
+ * --placement support.  Each cpu we're allowed to run on gets the first
+ * cpu of its SMT core, of its last level cache and its numa node as ids,
+ * straight from sysfs.
  */
-void *message_thread(void *arg)
-{
-	struct thread_data *td = arg;
-	struct thread_data *worker_threads_mem = NULL;
-	int i;
-	int ret;
+struct cpu_topo {
+	int core;
+	int llc;
+	int node;
+};
 
-	worker_threads_mem = calloc(worker_threads, sizeof(struct thread_data));
+static struct cpu_topo cpu_topo[CPUMASKSIZE];
+static cpu_set_t topo_cpus;
 
-	if (!worker_threads_mem) {
-		perror("unable to allocate ram");
-		pthread_exit((void *)-ENOMEM);
-	}
+/* the closest level of the topology two cpus share */
+static int classify_cpus(int a, int b)
+{
+	if (a < 0 || b < 0 || a >= CPUMASKSIZE || b >= CPUMASKSIZE)
+		return LOC_UNKNOWN;
+	if (a == b)
+		return LOC_CPU;
+	if (cpu_topo[a].core == cpu_topo[b].core)
+		return LOC_SMT;
+	if (cpu_topo[a].llc == cpu_topo[b].llc)
+		return LOC_LLC;
+	if (cpu_topo[a].node == cpu_topo[b].node)
+		return LOC_NODE;
+	return LOC_XNODE;
+}
 
-	for (i = 0; i < worker_threads; i++) {
-		pthread_t tid;
-		worker_threads_mem[i].msg_thread = td;
-		ret = pthread_create(&tid, NULL, worker_thread,
-				     worker_threads_mem + i);
-		if (ret) {
-			fprintf(stderr, "error %d from pthread_create\n", ret);
-			exit(1);
-		}
-		worker_threads_mem[i].tid = tid;
-	}
+static void record_locality(struct thread_data *td, unsigned long long delta)
+{
+	if (!locality || warming)
+		return;
+	add_lat(&loc_stats[classify_cpus(td->waker_cpu, td->woke_cpu)], delta);
+	add_lat(&loc_stats[LOC_NR + classify_cpus(td->block_cpu, td->woke_cpu)],
+		delta);
+}
 
-	if (requests_per_sec)
-		run_rps_thread(worker_threads_mem);
-	else
-		run_msg_thread(td);
+/*
+ * main swaps window_max back to zero when it snapshots, so the cmpxchg
+ * keeps a racing reset from being overwritten with an older max
+ */
+static void record_window_max(struct thread_data *td, unsigned long long delta)
+{
+	unsigned int val = delta > UINT_MAX ? UINT_MAX : delta;
+	unsigned int old = td->window_max;
+	unsigned int cur;
 
-	for (i = 0; i < worker_threads; i++) {
-		fpost(&worker_threads_mem[i].futex);
-		pthread_join(worker_threads_mem[i].tid, NULL);
-		combine_stats(&td->stats, &worker_threads_mem[i].stats);
-		td->loops_per_sec += worker_threads_mem[i].loops_per_sec;
+	if (warming)
+		return;
+	while (val > old) {
+		cur = __sync_val_compare_and_swap(&td->window_max, old, val);
+		if (cur == old)
+			break;
+		old = cur;
 	}
-	free(worker_threads_mem);
-
-	if (!requests_per_sec)
-		td->loops_per_sec /= worker_threads;
-	return NULL;
 }
 
-static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
-
-static double pretty_size(double number, char **str)
+/* parse a sysfs cpulist like 0-3,8-11 */
+static int read_cpulist(char *path, cpu_set_t *set)
 {
-	int divs = 0;
-
-	while(number >= 1024) {
-		if (units[divs + 1] == NULL)
+	char buf[4096];
+	char *p = buf;
+	FILE *f;
+	int first, last;
+
+	CPU_ZERO(set);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	while (*p && *p != '\n') {
+		first = strtol(p, &p, 10);
+		last = first;
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for (; first <= last && first < CPUMASKSIZE; first++)
+			CPU_SET(first, set);
+		if (*p == ',')
+			p++;
+		else
 			break;
-		divs++;
-		number /= 1024;
 	}
-	*str = units[divs];
-	return number;
+	return 0;
 }
 
-/* runtime from the command line is in seconds.  Sleep until its up */
-static void sleep_for_runtime()
+static int first_cpu(cpu_set_t *set, int def)
 {
-	struct timeval now;
-	struct timeval start;
-	unsigned long long delta;
-	unsigned long long runtime_usec = runtime * 1000000;
+	int cpu;
+
+	for (cpu = 0; cpu < CPUMASKSIZE; cpu++) {
+		if (CPU_ISSET(cpu, set))
+			return cpu;
+	}
+	return def;
+}
+
+static void read_topology(void)
+{
+	char path[256];
+	cpu_set_t set;
+	int cpu, idx, level, best, node;
+	FILE *f;
+
+	if (sched_getaffinity(0, sizeof(topo_cpus), &topo_cpus)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+
+	for (cpu = 0; cpu < CPUMASKSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &topo_cpus))
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		read_cpulist(path, &set);
+		cpu_topo[cpu].core = first_cpu(&set, cpu);
+
+		/* the highest level cache index is the llc */
+		cpu_topo[cpu].llc = 0;
+		best = 0;
+		for (idx = 0; ; idx++) {
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, idx);
+			f = fopen(path, "r");
+			if (!f)
+				break;
+			if (fscanf(f, "%d", &level) != 1)
+				level = 0;
+			fclose(f);
+			if (level < best)
+				continue;
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+			if (read_cpulist(path, &set))
+				continue;
+			best = level;
+			cpu_topo[cpu].llc = first_cpu(&set, cpu);
+		}
+		cpu_topo[cpu].node = 0;
+	}
+
+	for (node = 0; node < CPUMASKSIZE; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (read_cpulist(path, &set))
+			continue;
+		for (cpu = 0; cpu < CPUMASKSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set))
+				cpu_topo[cpu].node = node;
+		}
+	}
+}
+
+/*
+ * message thread 'index' gets its own core where we have enough of them,
+ * and the cpus its workers may use follow from the placement class.
+ * Returns the message thread cpu, or -1 if the class can't be built on
+ * this machine and everything is left to the scheduler.
+ */
+static int place_message_thread(int index, int placement, cpu_set_t *workers)
+{
+	struct cpu_topo *m;
+	int cores[CPUMASKSIZE];
+	int nr_cores = 0;
+	int cpu, msg_cpu, match;
+
+	for (cpu = 0; cpu < CPUMASKSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &topo_cpus) && cpu_topo[cpu].core == cpu)
+			cores[nr_cores++] = cpu;
+	}
+	if (!nr_cores)
+		return -1;
+	msg_cpu = cores[index % nr_cores];
+	m = &cpu_topo[msg_cpu];
+
+	CPU_ZERO(workers);
+	for (cpu = 0; cpu < CPUMASKSIZE; cpu++) {
+		struct cpu_topo *t = &cpu_topo[cpu];
+
+		if (!CPU_ISSET(cpu, &topo_cpus) || cpu == msg_cpu)
+			continue;
+		switch (placement) {
+		case PLACE_SMT:
+			match = t->core == m->core;
+			break;
+		case PLACE_LLC:
+			match = t->llc == m->llc && t->core != m->core;
+			break;
+		case PLACE_XLLC:
+			match = t->llc != m->llc && t->node == m->node;
+			break;
+		case PLACE_XNUMA:
+			match = t->node != m->node;
+			break;
+		default:
+			match = 0;
+			break;
+		}
+		if (match)
+			CPU_SET(cpu, workers);
+	}
+
+	/* no same-node llc to go to, any other llc will do */
+	if (placement == PLACE_XLLC && !CPU_COUNT(workers)) {
+		for (cpu = 0; cpu < CPUMASKSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &topo_cpus) && cpu_topo[cpu].llc != m->llc)
+				CPU_SET(cpu, workers);
+		}
+	}
+
+	if (!CPU_COUNT(workers))
+		return -1;
+	return msg_cpu;
+}
+
+/*
+ * grow msg's workers to nr, allocating and starting the new ones.  The
+ * message thread does this at startup, and main when an autobench step
+ * wants more workers than we've ever had; everyone is parked then
+ */
+static void add_workers(struct thread_data *msg, int nr)
+{
+	struct thread_data **workers;
+	struct thread_data *worker;
+	pthread_attr_t attr;
+	int first = msg->nr_workers;
+	int i;
+	int ret;
+
+	if (nr <= first)
+		return;
+	workers = realloc(msg->workers, nr * sizeof(*workers));
+	if (!workers) {
+		perror("unable to allocate ram");
+		exit(1);
+	}
+
+	for (i = first; i < nr; i++) {
+		worker = alloc_thread_data(1);
+		if (!worker) {
+			perror("unable to allocate ram");
+			exit(1);
+		}
+		worker->index = i;
+		worker->msg_thread = msg;
+		if (requests_per_sec && setup_request_pool(worker)) {
+			perror("unable to allocate request pool");
+			exit(1);
+		}
+		ret = setup_wakeup(worker);
+		if (ret) {
+			fprintf(stderr, "error %d setting up %s wakeups\n", ret,
+				wakeup_names[wakeup]);
+			exit(1);
+		}
+		workers[i] = worker;
+	}
+
+	/* main may be walking these for --interval, workers go first */
+	msg->workers = workers;
+	__sync_synchronize();
+	msg->nr_workers = nr;
+
+	pthread_attr_init(&attr);
+	if (msg->msg_cpu >= 0)
+		pthread_attr_setaffinity_np(&attr, sizeof(msg->worker_cpus),
+					    &msg->worker_cpus);
+
+	for (i = first; i < nr; i++) {
+		ret = pthread_create(&workers[i]->tid, &attr, worker_thread,
+				     workers[i]);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * the message thread starts his own gaggle of workers and then sits around
+ * replying when they post him.  He collects latency stats as all the threads
+ * exit
+ */
+void *message_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct thread_data *worker;
+	int i;
+
+	/*
+	 * our workers scribble on this, so it has to exist before they do.
+	 * A sweep sizes it for the last step
+	 */
+	td->sweep_fd = -1;
+	if (cache_test) {
+		int len = cache_test;
+
+		if (sweep_kb)
+			len = sweep_max_kb * 1024 / sizeof(double);
+
+		td->buffer = malloc(len * sizeof(double));
+		if (!td->buffer) {
+			perror("unable to allocate cache test buffer");
+			exit(1);
+		}
+		for(i=0; i<len; i++)
+			td->buffer[i] = rand();
+#ifndef NO_PERF_COUNTERS
+		if (sweep_kb)
+			td->sweep_fd = open_sweep_counters();
+		else
+			setup_counters(td->index);
+#endif
+	}
+
+	add_workers(td, worker_threads);
+
+	while (1) {
+		if (requests_per_sec && arrival != ARRIVAL_BATCH)
+			run_arrival_thread(td->workers);
+		else if (requests_per_sec)
+			run_rps_thread(td->workers);
+		else
+			run_msg_thread(td);
+
+		/* workers can't park while they're waiting on us */
+		for (i = 0; i < worker_threads; i++)
+			post_wake(td->workers[i]);
+		read_sweep_counters(td->sweep_fd, td->sweep_last, td->sweep_step);
+		if (!phase_park(-1))
+			break;
+	}
+	if (td->sweep_fd >= 0)
+		close(td->sweep_fd);
+
+	for (i = 0; i < td->nr_workers; i++) {
+		worker = td->workers[i];
+		post_wake(worker);
+		pthread_join(worker->tid, NULL);
+		combine_stats(&td->stats, &worker->stats);
+		combine_stats(&td->intended_stats, &worker->intended_stats);
+		td->loops_per_sec += worker->loops_per_sec;
+		free(worker->request_pool);
+		cleanup_wakeup(worker);
+		free(worker);
+	}
+	td->nr_workers = 0;
+	free(td->workers);
+	td->workers = NULL;
+	free(td->buffer);
+	td->buffer = NULL;
+
+	if (!requests_per_sec)
+		td->loops_per_sec /= worker_threads;
+	return NULL;
+}
+
+/*
+ * the end of an autobench step.  Wait for everyone to park, then move the
+ * worker stats up into their message threads the way the exit path would,
+ * and leave nothing queued for the next step
+ */
+static void park_threads(struct thread_data *msgs)
+{
+	struct thread_data *msg;
+	struct thread_data *worker;
+	struct request *req;
+	struct request *tmp;
+	int nr = message_threads;
+	int i, j;
+
+	for (i = 0; i < message_threads; i++) {
+		nr += msgs[i].nr_workers;
+		post_wake(&msgs[i]);
+	}
+	pthread_mutex_lock(&phase_lock);
+	while (nr_parked < nr)
+		pthread_cond_wait(&parked_cond, &phase_lock);
+	pthread_mutex_unlock(&phase_lock);
+
+	for (i = 0; i < message_threads; i++) {
+		msg = &msgs[i];
+		memset(&msg->stats, 0, sizeof(msg->stats));
+		memset(&msg->intended_stats, 0, sizeof(msg->intended_stats));
+		msg->loops_per_sec = 0;
+		xlist_splice(msg);
+
+		for (j = 0; j < worker_threads; j++) {
+			worker = msg->workers[j];
+			combine_stats(&msg->stats, &worker->stats);
+			combine_stats(&msg->intended_stats, &worker->intended_stats);
+			msg->loops_per_sec += worker->loops_per_sec;
+			memset(&worker->stats, 0, sizeof(worker->stats));
+			memset(&worker->intended_stats, 0, sizeof(worker->intended_stats));
+
+			req = request_splice(worker);
+			while (req) {
+				tmp = req->next;
+				free_request(worker, req);
+				req = tmp;
+			}
+		}
+		if (!requests_per_sec)
+			msg->loops_per_sec /= worker_threads;
+	}
+}
+
+/*
+ * start the next autobench step: spawn any workers we've never had, then
+ * let everyone out of phase_park()
+ */
+static void resume_threads(struct thread_data *msgs)
+{
+	int extra = 0;
+	int i;
+
+	for (i = 0; i < message_threads; i++) {
+		add_workers(&msgs[i], worker_threads);
+		if (msgs[i].nr_workers > worker_threads)
+			extra += msgs[i].nr_workers - worker_threads;
+	}
+
+	pthread_mutex_lock(&phase_lock);
+	nr_parked = extra;
+	phase++;
+	pthread_cond_broadcast(&phase_cond);
+	pthread_mutex_unlock(&phase_lock);
+}
+
+/* autobench is done, let the parked threads exit */
+static void finish_threads(struct thread_data *msgs)
+{
+	int i;
+
+	pthread_mutex_lock(&phase_lock);
+	phase_done = 1;
+	pthread_cond_broadcast(&phase_cond);
+	pthread_mutex_unlock(&phase_lock);
+
+	for (i = 0; i < message_threads; i++) {
+		pthread_join(msgs[i].tid, NULL);
+		cleanup_wakeup(&msgs[i]);
+	}
+}
+
+static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
+
+static double pretty_size(double number, char **str)
+{
+	int divs = 0;
+
+	while(number >= 1024) {
+		if (units[divs + 1] == NULL)
+			break;
+		divs++;
+		number /= 1024;
+	}
+	*str = units[divs];
+	return number;
+}
+
+/*
+ * worker histograms only ever count up, so the stats of a window are the
+ * difference of two snapshots.  The max can't be differenced, so each
+ * snapshot takes the workers' window_max and out->max is the real max
+ * since the previous snapshot.
+ */
+static void snapshot_worker_stats(struct thread_data *msgs, struct stats *out)
+{
+	struct thread_data *w;
+	unsigned int max, window_max = 0;
+	int i, j;
+
+	memset(out, 0, sizeof(*out));
+	for (i = 0; i < message_threads; i++) {
+		if (!msgs[i].workers)
+			continue;
+		for (j = 0; j < msgs[i].nr_workers; j++) {
+			w = msgs[i].workers[j];
+			combine_stats(out, &w->stats);
+			max = __sync_lock_test_and_set(&w->window_max, 0);
+			if (max > window_max)
+				window_max = max;
+		}
+	}
+	out->max = window_max;
+}
+
+static void stats_delta(struct stats *d, struct stats *now, struct stats *then)
+{
+	int i;
+
+	memset(d, 0, sizeof(*d));
+	for (i = 0; i < PLAT_NR; i++)
+		d->plat[i] = now->plat[i] - then->plat[i];
+	d->nr_samples = now->nr_samples - then->nr_samples;
+	d->max = now->max;
+}
+
+struct slo_point {
+	int rps;
+	double achieved;
+	double p99;
+};
+
+/* a rate we couldn't even generate doesn't count as meeting the slo */
+static int slo_ok(struct slo_point *pt)
+{
+	return pt->p99 <= slo_p99 && pt->achieved >= pt->rps * 0.9;
+}
+
+static int cmp_slo_point(const void *a, const void *b)
+{
+	return ((struct slo_point *)a)->rps - ((struct slo_point *)b)->rps;
+}
+
+static void slo_measure(struct thread_data *msgs, struct slo_point *pt)
+{
+	struct stats before, after, win;
+	double p95 = 0;
+
+	pt->p99 = 0;
+	requests_per_sec = pt->rps / message_threads;
+	if (requests_per_sec < 1)
+		requests_per_sec = 1;
+
+	sleep(warmup ? warmup : SLO_WARMUP);
+	snapshot_worker_stats(msgs, &before);
+	sleep(slo_window);
+	snapshot_worker_stats(msgs, &after);
+
+	stats_delta(&win, &after, &before);
+	calc_p99(&win, &p95, &pt->p99);
+	pt->achieved = (double)win.nr_samples / slo_window;
+	fprintf(text_out(), "slo: rps %d achieved %.2f p99 (usec) %.3f %s\n",
+		pt->rps, pt->achieved, pt->p99,
+		slo_ok(pt) ? "ok" : "over");
+}
+
+/*
+ * double the rate until the slo breaks, then bisect between the last good
+ * and first bad rate to within 1%.  The threads run throughout, only the
+ * target changes.  Prints the rps/p99 curve and sets stopping when done
+ */
+static void slo_search(struct thread_data *msgs, int start_rps)
+{
+	struct slo_point points[SLO_MAX_STEPS];
+	int nr = 0;
+	int lo = 0, hi = start_rps;
+	int best = -1;
+	int i;
+
+	while (nr < SLO_MAX_STEPS) {
+		points[nr].rps = hi;
+		slo_measure(msgs, &points[nr]);
+		if (!slo_ok(&points[nr++]))
+			break;
+		best = nr - 1;
+		lo = hi;
+		hi *= 2;
+	}
+
+	while (nr < SLO_MAX_STEPS && hi - lo > lo / 100 && hi - lo > message_threads) {
+		points[nr].rps = lo + (hi - lo) / 2;
+		slo_measure(msgs, &points[nr]);
+		if (slo_ok(&points[nr])) {
+			lo = points[nr].rps;
+			best = nr;
+		} else {
+			hi = points[nr].rps;
+		}
+		nr++;
+	}
+
+	__sync_synchronize();
+	stopping = 1;
+
+	if (best >= 0)
+		best = points[best].rps;
+	qsort(points, nr, sizeof(points[0]), cmp_slo_point);
+	fprintf(text_out(), "rps/p99 curve (usec):\n");
+	for (i = 0; i < nr; i++)
+		fprintf(text_out(), "\t%d %.2f %.3f\n", points[i].rps,
+			points[i].achieved, points[i].p99);
+	if (best >= 0)
+		fprintf(text_out(), "max rps with p99 under %.3f usec: %d\n", slo_p99, best);
+	else
+		fprintf(text_out(), "no rps kept p99 under %.3f usec\n", slo_p99);
+}
+
+/* --interval, print the percentiles of each interval until runtime is up */
+static void show_intervals(struct thread_data *msgs, struct timeval *start,
+			   unsigned long long runtime_usec)
+{
+	struct stats last, now, win;
+	struct timeval tv;
+	unsigned int *ovals = NULL;
+	unsigned long long elapsed = 0;
+	unsigned long long left;
+	int nr = 0;
+
+	snapshot_worker_stats(msgs, &last);
+	while (elapsed < runtime_usec) {
+		left = (runtime_usec - elapsed + 999999) / 1000000;
+		sleep(left < (unsigned long long)interval ? left : (unsigned long long)interval);
+		gettimeofday(&tv, NULL);
+		elapsed = tvdelta(start, &tv);
+
+		snapshot_worker_stats(msgs, &now);
+		stats_delta(&win, &now, &last);
+		last = now;
+		nr++;
+
+		if (calc_percentiles(win.plat, win.nr_samples, &ovals) > PLIST_P99)
+			fprintf(stderr, "interval %d (%llus): p50 %.3f p95 %.3f p99 %.3f max %.3f (usec) samples %u\n",
+				nr, elapsed / 1000000, ovals[0] / 1000.0,
+				ovals[PLIST_P95] / 1000.0, ovals[PLIST_P99] / 1000.0,
+				win.max / 1000.0, win.nr_samples);
+		free(ovals);
+		ovals = NULL;
+	}
+}
+
+/* file in <cgroup>/msgN, or in <cgroup> itself for index -1 */
+static void cgroup_path(char *buf, size_t len, int index, char *file)
+{
+	char *root = cgroup_name[0] == '/' ? "" : "/sys/fs/cgroup/";
+
+	if (index < 0)
+		snprintf(buf, len, "%s%s/%s", root, cgroup_name, file);
+	else
+		snprintf(buf, len, "%s%s/msg%d/%s", root, cgroup_name, index, file);
+}
+
+static int cgroup_write(int index, char *file, char *val)
+{
+	char path[PATH_MAX];
+	int fd;
+	int ret = 0;
+
+	cgroup_path(path, sizeof(path), index, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, strlen(val)) < 0) {
+		fprintf(stderr, "unable to write %s to %s: %s\n", val, path,
+			strerror(errno));
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/* make <cgroup> and a msgN under it for every message thread */
+static void setup_cgroups(void)
+{
+	char path[PATH_MAX];
+	char file[256];
+	char val[256];
+	char *set, *eq, *v;
+	int nr_vals;
+	int i, j, k;
+
+	cgroup_path(path, sizeof(path), -1, "");
+	if (mkdir(path, 0755) == 0)
+		cgroup_created = 1;
+	else if (errno != EEXIST) {
+		fprintf(stderr, "unable to create cgroup %s: %s\n", path,
+			strerror(errno));
+		exit(1);
+	}
+	/* without this msgN has no cpu.* files, the writes below will say so */
+	cgroup_write(-1, "cgroup.subtree_control", "+cpu");
+
+	for (i = 0; i < message_threads; i++) {
+		cgroup_path(path, sizeof(path), i, "");
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			fprintf(stderr, "unable to create cgroup %s: %s\n", path,
+				strerror(errno));
+			exit(1);
+		}
+		for (j = 0; j < nr_cgroup_sets; j++) {
+			set = cgroup_sets[j];
+			eq = strchr(set, '=');
+			v = eq + 1;
+			nr_vals = 1;
+			for (k = 0; v[k]; k++)
+				nr_vals += v[k] == ',';
+			for (k = i % nr_vals; k > 0; k--)
+				v = strchr(v, ',') + 1;
+			snprintf(file, sizeof(file), "%.*s", (int)(eq - set), set);
+			snprintf(val, sizeof(val), "%.*s", (int)strcspn(v, ","), v);
+			if (cgroup_write(i, file, val))
+				exit(1);
+		}
+	}
+}
+
+/* the groups are empty once the children are gone, errors don't matter */
+static void cleanup_cgroups(void)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < message_threads; i++) {
+		cgroup_path(path, sizeof(path), i, "");
+		rmdir(path);
+	}
+	if (cgroup_created) {
+		cgroup_path(path, sizeof(path), -1, "");
+		rmdir(path);
+	}
+}
+
+static void sleep_for_runtime(struct thread_data *msgs);
+
+/*
+ * --procs, fork a child that moves itself into its cgroup and then runs
+ * the message thread the way main would, with its own runtime clock.
+ * td is shared, so the stats message_thread() leaves there come back
+ */
+static pid_t start_msg_process(struct thread_data *td, pthread_attr_t *attr)
+{
+	char pid[32];
+	pid_t ret;
+	int err;
+
+	fflush(stdout);
+	fflush(stderr);
+	ret = fork();
+	if (ret < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (ret)
+		return ret;
+
+	if (cgroup_name) {
+		snprintf(pid, sizeof(pid), "%d", getpid());
+		if (cgroup_write(td->index, "cgroup.procs", pid))
+			exit(1);
+	}
+	err = pthread_create(&td->tid, attr, message_thread, td);
+	if (err) {
+		fprintf(stderr, "error %d from pthread_create\n", err);
+		exit(1);
+	}
+	sleep_for_runtime(td);
+	post_wake(td);
+	pthread_join(td->tid, NULL);
+	exit(0);
+}
+
+static void wait_msg_process(struct thread_data *td)
+{
+	int status;
+
+	if (waitpid(td->pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "message thread %d process failed\n", td->index);
+		exit(1);
+	}
+}
+
+/*
+ * runtime from the command line is in seconds, and starts after any
+ * warmup.  Sleep until its up
+ */
+static void sleep_for_runtime(struct thread_data *msgs)
+{
+	struct timeval now;
+	struct timeval start;
+	unsigned long long delta;
+	unsigned long long runtime_usec = runtime * 1000000ULL;
+
+	if (warmup) {
+		sleep(warmup);
+		__sync_synchronize();
+		warming = 0;
+	}
 
 	gettimeofday(&start, NULL);
-	sleep(runtime);
+	if (interval > 0)
+		show_intervals(msgs, &start, runtime_usec);
+	else
+		sleep(runtime);
 
 	while(1) {
 		gettimeofday(&now, NULL);
@@ -1065,22 +3075,278 @@ static void sleep_for_runtime()
 	stopping = 1;
 }
 
+/*
+ * one --cache-sweep row: the working set, wakeup latency and its growth
+ * over the first step, then cycles, ipc, llc miss rate and dtlb misses for
+ * the message threads (wakers) and the workers (wakees), per wakeup
+ */
+static void show_sweep_step(struct thread_data *msgs, struct stats *stats)
+{
+	static double base_p50;
+	static double base_p99;
+	unsigned long long waker[SWEEP_EVENTS] = { 0 };
+	unsigned long long wakee[SWEEP_EVENTS] = { 0 };
+	unsigned long long *c;
+	unsigned int *ovals = NULL;
+	double p50 = 0, p99 = 0;
+	double wakes = stats->nr_samples ? stats->nr_samples : 1;
+	int i, j, k, side;
+
+	if (calc_percentiles(stats->plat, stats->nr_samples, &ovals) > PLIST_P99) {
+		p50 = ovals[0] / 1000.0;
+		p99 = ovals[PLIST_P99] / 1000.0;
+	}
+	free(ovals);
+
+	for (i = 0; i < message_threads; i++) {
+		for (k = 0; k < SWEEP_EVENTS; k++)
+			waker[k] += msgs[i].sweep_step[k];
+		for (j = 0; j < worker_threads; j++) {
+			for (k = 0; k < SWEEP_EVENTS; k++)
+				wakee[k] += msgs[i].workers[j]->sweep_step[k];
+		}
+	}
+
+	if (sweep_kb == sweep_min_kb) {
+		base_p50 = p50;
+		base_p99 = p99;
+		if (!waker[SWEEP_CYCLES] && !wakee[SWEEP_CYCLES])
+			fprintf(stderr, "no perf counters, the sweep only has latencies\n");
+		fprintf(text_out(), "# ws_kb\tp50\tp99\tp50_pen\tp99_pen"
+			"\twaker_cyc\twaker_ipc\twaker_llc%%\twaker_dtlb"
+			"\twakee_cyc\twakee_ipc\twakee_llc%%\twakee_dtlb\n");
+	}
+
+	fprintf(text_out(), "%lu\t%.3f\t%.3f\t%.3f\t%.3f", sweep_kb, p50, p99,
+		p50 - base_p50, p99 - base_p99);
+	for (side = 0; side < 2; side++) {
+		c = side ? wakee : waker;
+		fprintf(text_out(), "\t%.0f\t%.2f\t%.2f\t%.2f",
+			c[SWEEP_CYCLES] / wakes,
+			c[SWEEP_CYCLES] ? (double)c[SWEEP_INSNS] / c[SWEEP_CYCLES] : 0,
+			c[SWEEP_LLC_LOADS] ? 100.0 * c[SWEEP_LLC_MISSES] / c[SWEEP_LLC_LOADS] : 0,
+			c[SWEEP_DTLB_MISSES] / wakes);
+	}
+	fprintf(text_out(), "\n");
+	fflush(stdout);
+}
+
+/* the histograms of this run that --hist-out saves */
+static void save_run_hists(struct stats *stats, struct stats *intended_stats,
+			   struct stats *msg_stats)
+{
+	char (*names)[HIST_NAME_LEN];
+	struct stats **hists;
+	struct wide_stats *wide;
+	int nr = 0;
+	int i;
+
+	names = calloc(2 + message_threads + nr_cpu_stats + 2 * LOC_NR, sizeof(*names));
+	hists = calloc(2 + message_threads + nr_cpu_stats + 2 * LOC_NR, sizeof(*hists));
+	if (!names || !hists) {
+		perror("calloc");
+		exit(1);
+	}
+
+	snprintf(names[nr], HIST_NAME_LEN, "overall");
+	hists[nr++] = stats;
+	if (requests_per_sec && arrival != ARRIVAL_BATCH) {
+		snprintf(names[nr], HIST_NAME_LEN, "intended");
+		hists[nr++] = intended_stats;
+	}
+	for (i = 0; msg_stats && i < message_threads; i++) {
+		snprintf(names[nr], HIST_NAME_LEN, "msg%d", i);
+		hists[nr++] = &msg_stats[i];
+	}
+	for (i = 0; cpu_stats && i < nr_cpu_stats; i++) {
+		if (!cpu_stats[i].nr_samples)
+			continue;
+		snprintf(names[nr], HIST_NAME_LEN, "cpu%d", i);
+		hists[nr++] = &cpu_stats[i];
+	}
+	for (i = 0; loc_stats && i < 2 * LOC_NR; i++) {
+		if (!loc_stats[i].nr_samples)
+			continue;
+		snprintf(names[nr], HIST_NAME_LEN, "%s_%s",
+			 i < LOC_NR ? "waker" : "block", locality_names[i % LOC_NR]);
+		hists[nr++] = &loc_stats[i];
+	}
+	wide = calloc(nr, sizeof(*wide));
+	if (!wide) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nr; i++)
+		widen_stats(&wide[i], hists[i]);
+	write_hists(hist_out, names, wide, nr);
+	free(wide);
+	free(names);
+	free(hists);
+}
+
+/*
+ * --hist-merge, add up histograms of the same name from every file and
+ * print the exact percentiles of the sums
+ */
+static int merge_hists(void)
+{
+	char (*names)[HIST_NAME_LEN] = NULL;
+	struct wide_stats *hists = NULL;
+	struct hist_header hdr;
+	struct hist_record rec;
+	struct wide_stats *s;
+	uint64_t pair[2];
+	FILE *f;
+	int nr = 0;
+	int i, h, b, n;
+
+	for (i = 0; i < nr_hist_files; i++) {
+		f = fopen(hist_files[i], "r");
+		if (!f) {
+			fprintf(stderr, "unable to open %s: %s\n", hist_files[i],
+				strerror(errno));
+			exit(1);
+		}
+		if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != HIST_MAGIC ||
+		    hdr.version != HIST_VERSION) {
+			fprintf(stderr, "%s is not a schbench histogram file\n",
+				hist_files[i]);
+			exit(1);
+		}
+		if (hdr.plat_bits != PLAT_BITS || hdr.plat_groups != PLAT_GROUP_NR) {
+			fprintf(stderr, "%s has %u/%u buckets, we use %u/%u\n",
+				hist_files[i], hdr.plat_bits, hdr.plat_groups,
+				PLAT_BITS, PLAT_GROUP_NR);
+			exit(1);
+		}
+
+		for (h = 0; h < (int)hdr.nr_hists; h++) {
+			if (fread(&rec, sizeof(rec), 1, f) != 1)
+				goto short_read;
+			rec.name[HIST_NAME_LEN - 1] = '\0';
+			for (n = 0; n < nr; n++) {
+				if (!strcmp(names[n], rec.name))
+					break;
+			}
+			if (n == nr) {
+				names = realloc(names, (nr + 1) * sizeof(*names));
+				hists = realloc(hists, (nr + 1) * sizeof(*hists));
+				if (!names || !hists) {
+					perror("realloc");
+					exit(1);
+				}
+				memset(&hists[nr], 0, sizeof(*hists));
+				memcpy(names[nr], rec.name, HIST_NAME_LEN);
+				hists[nr].min = rec.min;
+				nr++;
+			}
+			s = &hists[n];
+			s->nr_samples += rec.nr_samples;
+			if (rec.max > s->max)
+				s->max = rec.max;
+			if (rec.min < s->min)
+				s->min = rec.min;
+
+			for (b = 0; b < (int)rec.nr_buckets; b++) {
+				if (fread(pair, sizeof(pair), 1, f) != 1)
+					goto short_read;
+				if (pair[0] >= PLAT_NR) {
+					fprintf(stderr, "%s: bad bucket %llu\n",
+						hist_files[i],
+						(unsigned long long)pair[0]);
+					exit(1);
+				}
+				s->plat[pair[0]] += pair[1];
+			}
+		}
+		fclose(f);
+	}
+
+	for (n = 0; n < nr; n++) {
+		fprintf(stderr, "%s (%llu samples): ", names[n],
+			hists[n].nr_samples);
+		show_wide_latencies(&hists[n]);
+	}
+	if (json_output) {
+		printf("{");
+		for (n = 0; n < nr; n++) {
+			printf("%s\"%s\": ", n ? ", " : "", names[n]);
+			show_wide_json_stats(&hists[n]);
+		}
+		printf("}\n");
+	}
+	if (hist_out)
+		write_hists(hist_out, names, hists, nr);
+	return 0;
+
+short_read:
+	fprintf(stderr, "%s is truncated\n", hist_files[i]);
+	exit(1);
+}
+
 int main(int ac, char **av)
 {
 	int i;
 	int ret;
 	struct thread_data *message_threads_mem = NULL;
 	struct stats stats;
+	struct stats intended_stats;
 	double loops_per_sec;
 	double avg_requests_per_sec;
-	int p99 = 0;
-	int p95 = 0;
+	double p99 = 0;
+	double p95 = 0;
 	double diff;
+	struct stats place_stats[PLACE_NR];
+	struct stats *msg_stats = NULL;
+	pthread_attr_t attr;
+	cpu_set_t msg_cpus;
 
 
 	parse_options(ac, av);
-	if (autobench && requests_per_sec == 1) {
-		unsigned long per_thread = 1000000 / (cputime + cputime / 4);
+	if (hist_merge)
+		return merge_hists();
+	if (use_tsc)
+		calibrate_tsc();
+	calibrate_think();
+	if (nr_placements || locality)
+		read_topology();
+	if (procs) {
+		request_pool_misses = alloc_shared(sizeof(*request_pool_misses));
+		if (!request_pool_misses) {
+			perror("unable to allocate shared request pool misses");
+			exit(1);
+		}
+	}
+	if (locality) {
+		if (procs)
+			loc_stats = alloc_shared(2 * LOC_NR * sizeof(struct stats));
+		else
+			loc_stats = calloc(2 * LOC_NR, sizeof(struct stats));
+		if (!loc_stats) {
+			perror("unable to allocate locality stats");
+			exit(1);
+		}
+	}
+	if (per_cpu_stats) {
+		nr_cpu_stats = sysconf(_SC_NPROCESSORS_CONF);
+		if (nr_cpu_stats <= 0 || nr_cpu_stats > CPUMASKSIZE)
+			nr_cpu_stats = CPUMASKSIZE;
+		if (procs)
+			cpu_stats = alloc_shared(nr_cpu_stats * sizeof(struct stats));
+		else
+			cpu_stats = calloc(nr_cpu_stats, sizeof(struct stats));
+	}
+	if (per_msg_stats)
+		msg_stats = calloc(message_threads, sizeof(struct stats));
+	persistent = (autobench || sweep_kb) && slo_p99 <= 0;
+	if ((per_cpu_stats && !cpu_stats) || (per_msg_stats && !msg_stats)) {
+		perror("unable to allocate per cpu/msg stats");
+		exit(1);
+	}
+	if (slo_p99 > 0 && requests_per_sec == 0)
+		requests_per_sec = 1;
+	if ((autobench || slo_p99 > 0) && requests_per_sec == 1) {
+		unsigned long per_thread = 1000000 / (cputime + cputime / 4 + 1);
 		requests_per_sec = per_thread * worker_threads * message_threads;
 		requests_per_sec = (requests_per_sec * 75) / 100;
 		fprintf(stderr, "autobench rps %d\n", requests_per_sec);
@@ -1091,10 +3357,29 @@ again:
 	loops_per_sec = 0;
 	avg_requests_per_sec = 0;
 	stopping = 0;
+	/* --slo takes its own snapshots after a warmup */
+	warming = warmup > 0 && slo_p99 <= 0;
 	memset(&stats, 0, sizeof(stats));
+	memset(&intended_stats, 0, sizeof(intended_stats));
+	memset(place_stats, 0, sizeof(place_stats));
+	if (cpu_stats)
+		memset(cpu_stats, 0, nr_cpu_stats * sizeof(struct stats));
+	if (loc_stats)
+		memset(loc_stats, 0, 2 * LOC_NR * sizeof(struct stats));
+	if (msg_stats)
+		memset(msg_stats, 0, message_threads * sizeof(struct stats));
+
+	/* autobench steps after the first reuse the threads they parked */
+	if (message_threads_mem) {
+		resume_threads(message_threads_mem);
+		goto running;
+	}
 
-	message_threads_mem = calloc(message_threads,
-				      sizeof(struct thread_data));
+	if (procs)
+		message_threads_mem = alloc_shared(message_threads *
+						   sizeof(struct thread_data));
+	else
+		message_threads_mem = alloc_thread_data(message_threads);
 
 
 	if (!message_threads_mem) {
@@ -1102,39 +3387,108 @@ again:
 		exit(1);
 	}
 
+	if (cgroup_name)
+		setup_cgroups();
+
 	/* start our message threads, each one starts its own workers */
 	for (i = 0; i < message_threads; i++) {
+		struct thread_data *td = message_threads_mem + i;
 		pthread_t tid;
-		message_threads_mem[i].index = i;
 
-		ret = pthread_create(&tid, NULL, message_thread,
-				     message_threads_mem + i);
+		td->index = i;
+		td->msg_cpu = -1;
+		ret = setup_wakeup(td);
+		if (ret) {
+			fprintf(stderr, "error %d setting up %s wakeups\n", ret,
+				wakeup_names[wakeup]);
+			exit(1);
+		}
+		pthread_attr_init(&attr);
+		if (nr_placements) {
+			td->placement = placements[i % nr_placements];
+			td->msg_cpu = place_message_thread(i, td->placement,
+							   &td->worker_cpus);
+			if (td->msg_cpu < 0) {
+				fprintf(stderr, "message thread %d: no cpus for %s placement, not pinning\n",
+					i, placement_names[td->placement]);
+			} else {
+				CPU_ZERO(&msg_cpus);
+				CPU_SET(td->msg_cpu, &msg_cpus);
+				pthread_attr_setaffinity_np(&attr, sizeof(msg_cpus),
+							    &msg_cpus);
+			}
+		}
+
+		if (procs) {
+			td->pid = start_msg_process(td, &attr);
+			pthread_attr_destroy(&attr);
+			continue;
+		}
+		ret = pthread_create(&tid, &attr, message_thread, td);
 		if (ret) {
 			fprintf(stderr, "error %d from pthread_create\n", ret);
 			exit(1);
 		}
-		message_threads_mem[i].tid = tid;
+		pthread_attr_destroy(&attr);
+		td->tid = tid;
 	}
 
-	sleep_for_runtime();
+running:
+	if (slo_p99 > 0)
+		slo_search(message_threads_mem, requests_per_sec * message_threads);
+	else if (!procs)
+		sleep_for_runtime(message_threads_mem);
 
+	if (persistent)
+		park_threads(message_threads_mem);
 	for (i = 0; i < message_threads; i++) {
-		fpost(&message_threads_mem[i].futex);
-		pthread_join(message_threads_mem[i].tid, NULL);
+		if (procs) {
+			wait_msg_process(&message_threads_mem[i]);
+			cleanup_wakeup(&message_threads_mem[i]);
+		} else if (!persistent) {
+			post_wake(&message_threads_mem[i]);
+			pthread_join(message_threads_mem[i].tid, NULL);
+			cleanup_wakeup(&message_threads_mem[i]);
+		}
 		combine_stats(&stats, &message_threads_mem[i].stats);
+		combine_stats(&intended_stats, &message_threads_mem[i].intended_stats);
+		combine_stats(&place_stats[message_threads_mem[i].placement],
+			      &message_threads_mem[i].stats);
+		if (msg_stats)
+			msg_stats[i] = message_threads_mem[i].stats;
 		loops_per_sec += message_threads_mem[i].loops_per_sec;
 		avg_requests_per_sec += message_threads_mem[i].loops_per_sec;
 	}
 	loops_per_sec /= message_threads;
-
-	free(message_threads_mem);
+	if (cgroup_name)
+		cleanup_cgroups();
+
+	if (procs) {
+		munmap(message_threads_mem, message_threads * sizeof(struct thread_data));
+		message_threads_mem = NULL;
+	} else if (!persistent) {
+		free(message_threads_mem);
+		message_threads_mem = NULL;
+	}
+	if (slo_p99 > 0)
+		return 0;
 	calc_p99(&stats, &p95, &p99);
 
 	/*
 	 * in auto bench mode, keep adding workers until our latencies get
-	 * horrible
+	 * horrible.  --cache-sweep steps the same way, keeping the threads
+	 * and their buffers
 	 */
-	if (autobench && requests_per_sec) {
+	if (sweep_kb) {
+		show_sweep_step(message_threads_mem, &stats);
+		if (sweep_kb < sweep_max_kb) {
+			sweep_kb *= 2;
+			if (sweep_kb > sweep_max_kb)
+				sweep_kb = sweep_max_kb;
+			cache_test = sweep_kb * 1024 / sizeof(double);
+			goto again;
+		}
+	} else if (autobench && requests_per_sec) {
 		diff = (double)p99 / cputime;
 		if (diff < 5) {
 			int bump;
@@ -1154,7 +3508,7 @@ again:
 
 			bump = ((bump + 4) / 5) * 5;
 
-			fprintf(stdout, "rps: %.2f p95 (usec) %d p99 (usec) %d p95/cputime %.2f%% p99/cputime %.2f%%\n",
+			fprintf(text_out(), "rps: %.2f p95 (usec) %.3f p99 (usec) %.3f p95/cputime %.2f%% p99/cputime %.2f%%\n",
 				avg_requests_per_sec, p95, p99, ((double)p95 / cputime) * 100,
 				diff * 100);
 			requests_per_sec += bump;
@@ -1162,7 +3516,7 @@ again:
 		}
 
 	} else if (autobench) {
-		fprintf(stdout, "cputime %Lu threads %d p99 %d\n",
+		fprintf(text_out(), "cputime %Lu threads %d p99 %.3f\n",
 			cputime, worker_threads, p99);
 		if (p99 < 2000) {
 			worker_threads++;
@@ -1173,31 +3527,134 @@ again:
 		show_latencies(&stats);
 	}
 
+	if (persistent) {
+		finish_threads(message_threads_mem);
+		free(message_threads_mem);
+	}
+
+	/* open loop arrivals are also measured from when they should have started */
+	if (requests_per_sec && arrival != ARRIVAL_BATCH) {
+		fprintf(stderr, "From intended arrival: ");
+		show_latencies(&intended_stats);
+	}
+
+	/* the same percentiles for each placement class that was used */
+	for (i = 0; i < nr_placements; i++) {
+		int p = placements[i];
+
+		if (i >= message_threads)
+			break;
+		fprintf(stderr, "Placement %s: ", placement_names[p]);
+		show_latencies(&place_stats[p]);
+	}
+	for (i = 0; msg_stats && i < message_threads; i++) {
+		fprintf(stderr, "Message thread %d: ", i);
+		show_latencies(&msg_stats[i]);
+	}
+	for (i = 0; cpu_stats && i < nr_cpu_stats; i++) {
+		if (!cpu_stats[i].nr_samples)
+			continue;
+		fprintf(stderr, "CPU %d: ", i);
+		show_latencies(&cpu_stats[i]);
+	}
+	for (i = 0; loc_stats && i < 2 * LOC_NR; i++) {
+		if (!loc_stats[i].nr_samples)
+			continue;
+		fprintf(stderr, "%s %s (%.1f%%): ",
+			i < LOC_NR ? "Waker->wakee" : "Block->wake",
+			locality_names[i % LOC_NR],
+			100.0 * loc_stats[i].nr_samples / (stats.nr_samples ? stats.nr_samples : 1));
+		show_latencies(&loc_stats[i]);
+	}
+
+	if (json_output) {
+		int first = 1;
+
+		printf("{\"wakeup\": \"%s\", \"overall\": ", wakeup_names[wakeup]);
+		show_json_stats(&stats);
+		if (requests_per_sec && arrival != ARRIVAL_BATCH) {
+			printf(", \"intended\": ");
+			show_json_stats(&intended_stats);
+		}
+		if (nr_placements) {
+			printf(", \"placements\": {");
+			for (i = 0; i < nr_placements && i < message_threads; i++) {
+				printf("%s\"%s\": ", i ? ", " : "", placement_names[placements[i]]);
+				show_json_stats(&place_stats[placements[i]]);
+			}
+			printf("}");
+		}
+		if (msg_stats) {
+			printf(", \"message_threads\": [");
+			for (i = 0; i < message_threads; i++) {
+				printf("%s{\"index\": %d, \"stats\": ", i ? ", " : "", i);
+				show_json_stats(&msg_stats[i]);
+				printf("}");
+			}
+			printf("]");
+		}
+		if (cpu_stats) {
+			printf(", \"cpus\": [");
+			for (i = 0; i < nr_cpu_stats; i++) {
+				if (!cpu_stats[i].nr_samples)
+					continue;
+				printf("%s{\"cpu\": %d, \"stats\": ", first ? "" : ", ", i);
+				show_json_stats(&cpu_stats[i]);
+				printf("}");
+				first = 0;
+			}
+			printf("]");
+		}
+		if (loc_stats) {
+			printf(", \"locality\": {");
+			for (i = 0; i < 2 * LOC_NR; i++) {
+				if (i % LOC_NR == 0)
+					printf("%s\"%s\": {", i ? "}, " : "",
+					       i < LOC_NR ? "waker" : "block");
+				printf("%s\"%s\": ", i % LOC_NR ? ", " : "",
+				       locality_names[i % LOC_NR]);
+				show_json_stats(&loc_stats[i]);
+			}
+			printf("}}");
+		}
+		printf("}\n");
+	}
+
+	if (hist_out)
+		save_run_hists(&stats, &intended_stats, msg_stats);
+
 	if (pipe_test) {
 		char *pretty;
 		double mb_per_sec;
 		mb_per_sec = loops_per_sec * pipe_test;
 		mb_per_sec = pretty_size(mb_per_sec, &pretty);
-		printf("avg worker transfer: %.2f ops/sec %.2f%s/s\n",
-		       loops_per_sec, mb_per_sec, pretty);
+		fprintf(text_out(), "avg worker transfer: %.2f ops/sec %.2f%s/s\n",
+			loops_per_sec, mb_per_sec, pretty);
 
 	}
 
-	if(cache_test) {
+	if(cache_test && !sweep_kb) {
 		for (i = 0; i < message_threads; i++)
-			printf("tid=%d: Total time penalty for cache access=%llu\n",i, time_diff[i]);
+			fprintf(text_out(), "tid=%d: Total time penalty for cache access=%llu\n",i, time_diff[i] / 1000);
 	}
 
-	if (cache_test) {
+	if (cache_test && !sweep_kb) {
 		for (i = 0; i < message_threads; i++)
-			printf("tid=%d cacche-miss-rate=%f%%  total-cache-ref=%lld total-cache-miss=%lld\n",i, (double)100.0*cache_miss_total[i]/cache_refs_total[i], cache_refs_total[i], cache_miss_total[i]);
+			fprintf(text_out(), "tid=%d cacche-miss-rate=%f%%  total-cache-ref=%lld total-cache-miss=%lld\n",i, (double)100.0*cache_miss_total[i]/cache_refs_total[i], cache_refs_total[i], cache_miss_total[i]);
 	}
 
+	if (requests_per_sec && *request_pool_misses)
+		fprintf(text_out(), "request pool misses: %lu\n", *request_pool_misses);
+
 	if (requests_per_sec) {
 		diff = (double)p99 / cputime;
-		fprintf(stdout, "rps: %.2f p95 (usec) %d p99 (usec) %d p95/cputime %.2f%% p99/cputime %.2f%%\n",
+		fprintf(text_out(), "rps: %.2f p95 (usec) %.3f p99 (usec) %.3f p95/cputime %.2f%% p99/cputime %.2f%%\n",
 				avg_requests_per_sec, p95, p99, ((double)p95 / cputime) * 100,
 				diff * 100);
+		if (arrival != ARRIVAL_BATCH) {
+			calc_p99(&intended_stats, &p95, &p99);
+			fprintf(text_out(), "intended: p95 (usec) %.3f p99 (usec) %.3f\n", p95, p99);
+		}
 	}
 
 	return 0;
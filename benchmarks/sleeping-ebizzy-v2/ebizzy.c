@@ -41,12 +41,18 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -67,11 +73,100 @@ static unsigned int chunk_size;
 static unsigned int seconds;
 static unsigned int threads;
 static unsigned int verbose;
-static unsigned int linear;
 static unsigned int touch_pages;
 static unsigned int no_lib_memcpy;
 static unsigned int sleep_at;
 static unsigned int sleep_interval;
+static unsigned int phase_lat;
+static unsigned int util_pct;
+static unsigned int period_us;
+static unsigned int rate;
+static int arrival_mode;
+static int alloc_mode = -1;
+static int search_mode;
+
+/*
+ * How search_mem looks up its key.  bsearch is libc's, linear is the
+ * original sanity check, branchless is an inline binary search the
+ * compiler can turn into conditional moves, eytzinger copies the chunk
+ * into breadth first (heap) order and walks it, and simd compares four
+ * records at a time.  Anything but bsearch gets checked against bsearch
+ * before we start.
+ */
+
+enum {
+	SEARCH_BSEARCH,
+	SEARCH_LINEAR,
+	SEARCH_BRANCHLESS,
+	SEARCH_EYTZINGER,
+	SEARCH_SIMD,
+	NR_SEARCH_MODES
+};
+
+static const char *search_names[NR_SEARCH_MODES] = {
+	"bsearch", "linear", "branchless", "eytzinger", "simd"
+};
+
+/*
+ * Sleep models that don't depend on how fast we get through records.
+ * -u runs each thread for util% of every period and sleeps the rest;
+ * -r treats every record as a request arriving at rate per second per
+ * thread, open loop, so a slow request leaves the next ones queued
+ * rather than pushing them back.  Both sleep to absolute deadlines.
+ */
+
+enum {
+	ARRIVAL_PERIODIC,
+	ARRIVAL_POISSON,
+	NR_ARRIVAL_MODES
+};
+
+static const char *arrival_names[NR_ARRIVAL_MODES] = { "periodic", "poisson" };
+
+/*
+ * Where search_mem gets its copy buffers.  malloc and mmap go to the
+ * system for every record, pool reuses one buffer per thread and arena
+ * bumps through ARENA_COPIES worth of per thread memory, rewinding when
+ * it runs out.  Chunks themselves still follow -m/-M.
+ */
+
+enum {
+	ALLOC_MALLOC,
+	ALLOC_MMAP,
+	ALLOC_POOL,
+	ALLOC_ARENA,
+	NR_ALLOC_MODES
+};
+
+static const char *alloc_names[NR_ALLOC_MODES] = { "malloc", "mmap", "pool", "arena" };
+
+#define ARENA_COPIES	16
+
+/*
+ * -N chunk placement.  Threads go round robin over the nodes and are
+ * pinned there.  interleave puts chunk i on node i % nodes; local gives
+ * each node the chunks that land on it and only lets its own threads
+ * search them; remote does the same but has threads search the next
+ * node's chunks.
+ */
+
+enum {
+	NUMA_NONE,
+	NUMA_INTERLEAVE,
+	NUMA_LOCAL,
+	NUMA_REMOTE,
+	NR_NUMA_MODES
+};
+
+static const char *numa_names[NR_NUMA_MODES] = { "none", "interleave", "local", "remote" };
+static int numa_mode = NUMA_NONE;
+
+#define MAX_NODES	64
+static int nr_nodes = 1;
+static int node_ids[MAX_NODES];
+#ifdef HAVE_NUMA
+static cpu_set_t node_cpus[MAX_NODES];
+#endif
 
 
 /*
@@ -86,11 +181,76 @@ static char **hole_mem;
 static unsigned int page_size;
 static time_t start_time;
 static volatile int threads_go;
+static volatile unsigned int threads_ready;
 static unsigned int records_read;
 
 /* Global local to serialize records aggregation */
 pthread_mutex_t records_count_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Per phase latency histograms for -L.  Log-linear in nanoseconds: the
+ * first LAT_SUB buckets are exact, after that every power of two is split
+ * into LAT_SUB buckets, so the error stays under 1/LAT_SUB.
+ */
+
+#define LAT_SUB_BITS	5
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_GROUPS	40
+#define LAT_BUCKETS	(LAT_GROUPS * LAT_SUB)
+
+enum {
+	PHASE_ALLOC,
+	PHASE_COPY,
+	PHASE_SEARCH,
+	PHASE_FREE,
+	NR_PHASES
+};
+
+static const char *phase_names[NR_PHASES] = { "alloc", "copy", "search", "free" };
+
+struct lat_hist {
+	unsigned long long count[LAT_BUCKETS];
+	unsigned long long nr;
+	unsigned long long max;
+};
+
+struct thread_lat {
+	struct lat_hist phase[NR_PHASES];
+};
+
+struct thread_info {
+	struct thread_lat *lat;
+	/* pool and arena memory */
+	char *pool;
+	size_t pool_size;
+	size_t pool_off;
+	/* -N node index we run on, and the slice of chunks we search */
+	int node;
+	int slice;
+	unsigned int nr_slice;
+	unsigned int records;
+	unsigned long long copied;
+	/* -u and -r pacing */
+	struct lat_hist *wake;
+	unsigned long long deadline;
+	unsigned long long busy_until;
+	unsigned long long rng;
+	unsigned long long overruns;
+	unsigned long long cpu_ns;
+	unsigned long long wall_ns;
+};
+
+static struct option long_options[] = {
+	{"alloc", required_argument, 0, 'A'},
+	{"numa", required_argument, 0, 'N'},
+	{"search", required_argument, 0, 'f'},
+	{"util", required_argument, 0, 'u'},
+	{"period", required_argument, 0, 'w'},
+	{"rate", required_argument, 0, 'r'},
+	{"arrival", required_argument, 0, 'd'},
+	{0, 0, 0, 0}
+};
+
 static void
 usage(void)
 {
@@ -107,7 +267,15 @@ usage(void)
 		"-S <seconds>\t Number of seconds to run\n"
 		"-t <num>\t Number of threads (2 * number cpus by default)\n"
 		"-v[v[v]]\t Be verbose (more v's for more verbose)\n"
-		"-z\t\t Linear search instead of binary search\n",
+		"-z\t\t Linear search instead of binary search (-f linear)\n"
+		"-f, --search <kernel> bsearch, linear, branchless, eytzinger or simd\n"
+		"-L\t\t Report per phase (alloc/copy/search/free) latencies\n"
+		"-A, --alloc <mode> Copy buffers from malloc, mmap, pool or arena\n"
+		"-N, --numa <mode> Chunks on nodes: none, interleave, local or remote\n"
+		"-u, --util <pct> Busy pct of every period per thread, sleep the rest\n"
+		"-w, --period <usec> Period for -u (10000 by default)\n"
+		"-r, --rate <num> Records per second per thread, open loop\n"
+		"-d, --arrival <model> Arrivals for -r: periodic or poisson\n",
 		cmd);
 	exit(1);
 }
@@ -137,13 +305,15 @@ read_options(int argc, char *argv[])
 	seconds = 10;
 	sleep_at = 0;
 	sleep_interval = 1000;
+	period_us = 10000;
 
 	/* On to option processing */
 
 	cmd = argv[0];
 	opterr = 1;
 
-	while ((c = getopt(argc, argv, "lmMn:pPRs:S:t:vzTa:i:")) != -1) {
+	while ((c = getopt_long(argc, argv, "lmMn:pPRs:S:t:vzTa:i:LA:N:f:u:w:r:d:",
+				long_options, NULL)) != -1) {
 		switch (c) {
 		case 'l':
 			no_lib_memcpy = 1;
@@ -190,7 +360,36 @@ read_options(int argc, char *argv[])
 			verbose++;
 			break;
 		case 'z':
-			linear = 1;
+			search_mode = SEARCH_LINEAR;
+			break;
+		case 'f':
+			for (search_mode = 0; search_mode < NR_SEARCH_MODES; search_mode++)
+				if (!strcmp(optarg, search_names[search_mode]))
+					break;
+			if (search_mode == NR_SEARCH_MODES)
+				usage();
+			break;
+		case 'u':
+			util_pct = atoi(optarg);
+			if (util_pct == 0 || util_pct >= 100)
+				usage();
+			break;
+		case 'w':
+			period_us = atoi(optarg);
+			if (period_us == 0)
+				usage();
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			if (rate == 0)
+				usage();
+			break;
+		case 'd':
+			for (arrival_mode = 0; arrival_mode < NR_ARRIVAL_MODES; arrival_mode++)
+				if (!strcmp(optarg, arrival_names[arrival_mode]))
+					break;
+			if (arrival_mode == NR_ARRIVAL_MODES)
+				usage();
 			break;
 		case 'a':
 			sleep_at = atoi(optarg);
@@ -198,6 +397,23 @@ read_options(int argc, char *argv[])
 		case 'i':
 			sleep_interval = atoi(optarg);
 			break;
+		case 'L':
+			phase_lat = 1;
+			break;
+		case 'A':
+			for (alloc_mode = 0; alloc_mode < NR_ALLOC_MODES; alloc_mode++)
+				if (!strcmp(optarg, alloc_names[alloc_mode]))
+					break;
+			if (alloc_mode == NR_ALLOC_MODES)
+				usage();
+			break;
+		case 'N':
+			for (numa_mode = 0; numa_mode < NR_NUMA_MODES; numa_mode++)
+				if (!strcmp(optarg, numa_names[numa_mode]))
+					break;
+			if (numa_mode == NR_NUMA_MODES)
+				usage();
+			break;
 
 		default:
 			usage();
@@ -209,6 +425,9 @@ read_options(int argc, char *argv[])
 		       "(C) 2006-7 Intel Corporation\n"
 		       "(C) 2007 Valerie Henson <val@nmt.edu>\n");
 
+	if (alloc_mode < 0)
+		alloc_mode = always_mmap ? ALLOC_MMAP : ALLOC_MALLOC;
+
 	if (verbose) {
 		printf("always_mmap %u\n", always_mmap);
 		printf("never_mmap %u\n", never_mmap);
@@ -221,9 +440,15 @@ read_options(int argc, char *argv[])
 		printf("seconds %d\n", seconds);
 		printf("threads %u\n", threads);
 		printf("verbose %u\n", verbose);
-		printf("linear %u\n", linear);
+		printf("search %s\n", search_names[search_mode]);
 		printf("touch_pages %u\n", touch_pages);
 		printf("page size %d\n", page_size);
+		printf("alloc %s\n", alloc_names[alloc_mode]);
+		printf("numa %s\n", numa_names[numa_mode]);
+		if (util_pct)
+			printf("util %u%% of %u usec\n", util_pct, period_us);
+		if (rate)
+			printf("rate %u/s %s\n", rate, arrival_names[arrival_mode]);
 	}
 
 	/* Check for incompatible options */
@@ -234,6 +459,11 @@ read_options(int argc, char *argv[])
 		usage();
 	}
 
+	if (!!util_pct + !!rate + !!sleep_at > 1) {
+		fprintf(stderr, "Only one of -u, -r and -a at a time\n");
+		usage();
+	}
+
 	if (never_mmap)
 		mallopt(M_MMAP_MAX, 0);
 
@@ -242,8 +472,117 @@ read_options(int argc, char *argv[])
 			chunk_size, record_size);
 		usage();
 	}
+
+#ifndef HAVE_NUMA
+	if (numa_mode != NUMA_NONE) {
+		fprintf(stderr, "-N needs Linux\n");
+		usage();
+	}
+#endif
+}
+
+#ifdef HAVE_NUMA
+/*
+ * Nodes and their cpus straight from sysfs, so we don't need libnuma.
+ * No sysfs means one node with every cpu we may use.
+ */
+
+static int
+read_cpulist(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	char *p = buf;
+	FILE *f;
+	int first, last;
+
+	CPU_ZERO(set);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fgets(buf, sizeof(buf), f) == NULL) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	while (*p && *p != '\n') {
+		first = strtol(p, &p, 10);
+		last = first;
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (*p != ',')
+			break;
+		p++;
+	}
+	return 0;
 }
 
+static void
+read_nodes(void)
+{
+	char path[256];
+	int id;
+
+	nr_nodes = 0;
+	for (id = 0; id < MAX_NODES; id++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", id);
+		if (read_cpulist(path, &node_cpus[nr_nodes]) ||
+		    CPU_COUNT(&node_cpus[nr_nodes]) == 0)
+			continue;
+		node_ids[nr_nodes++] = id;
+	}
+	if (nr_nodes == 0) {
+		nr_nodes = 1;
+		node_ids[0] = 0;
+		sched_getaffinity(0, sizeof(node_cpus[0]), &node_cpus[0]);
+	}
+
+	if ((numa_mode == NUMA_LOCAL || numa_mode == NUMA_REMOTE) &&
+	    chunks < nr_nodes) {
+		fprintf(stderr, "-N %s needs at least one chunk per node, "
+			"%d nodes\n", numa_names[numa_mode], nr_nodes);
+		exit(1);
+	}
+	if (numa_mode == NUMA_REMOTE && nr_nodes == 1)
+		fprintf(stderr, "Only one node, remote access is local\n");
+	if (verbose)
+		printf("%d nodes\n", nr_nodes);
+}
+
+/* Bind before write_pattern touches the chunk, first touch would win */
+static void
+bind_mem(void *p, size_t size, int node)
+{
+	unsigned long mask[(MAX_NODES + 8 * sizeof(unsigned long) - 1) /
+			   (8 * sizeof(unsigned long))];
+	int id = node_ids[node];
+
+	memset(mask, 0, sizeof(mask));
+	mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_mbind, p, size, MPOL_BIND, mask, MAX_NODES + 1, 0))
+		perror("mbind");
+}
+
+static void
+pin_thread(struct thread_info *ti)
+{
+	int err;
+
+	err = pthread_setaffinity_np(pthread_self(), sizeof(node_cpus[ti->node]),
+				     &node_cpus[ti->node]);
+	if (err)
+		fprintf(stderr, "Couldn't pin thread to node %d\n",
+			node_ids[ti->node]);
+}
+#else
+static void read_nodes(void) { }
+static void bind_mem(void *p, size_t size, int node) { }
+static void pin_thread(struct thread_info *ti) { }
+#endif
+
 static void
 touch_mem(char *dest, size_t size)
 {
@@ -255,12 +594,12 @@ touch_mem(char *dest, size_t size)
 }
 
 static void *
-alloc_mem(size_t size)
+sys_alloc(size_t size, int use_mmap)
 {
 	char *p;
 	int err = 0;
 
-	if (always_mmap) {
+	if (use_mmap) {
 		p = mmap((void *) 0, size, (PROT_READ | PROT_WRITE),
 			 (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
 		if (p == MAP_FAILED)
@@ -283,14 +622,73 @@ alloc_mem(size_t size)
 }
 
 static void
-free_mem(void *p, size_t size)
+sys_free(void *p, size_t size, int use_mmap)
 {
-	if (always_mmap)
+	if (use_mmap)
 		munmap(p, size);
 	else
 		free(p);
 }
 
+static void *
+alloc_mem(size_t size)
+{
+	return sys_alloc(size, always_mmap);
+}
+
+static void
+free_mem(void *p, size_t size)
+{
+	sys_free(p, size, always_mmap);
+}
+
+/*
+ * Per thread pool or arena, faulted in before the clock starts so the
+ * run only sees reuse.
+ */
+
+static void
+setup_copy_pool(struct thread_info *ti)
+{
+	if (alloc_mode == ALLOC_POOL)
+		ti->pool_size = chunk_size;
+	else if (alloc_mode == ALLOC_ARENA)
+		ti->pool_size = (size_t) ARENA_COPIES * chunk_size;
+	else
+		return;
+	ti->pool = alloc_mem(ti->pool_size);
+	memset(ti->pool, 0, ti->pool_size);
+	ti->pool_off = 0;
+}
+
+static void *
+alloc_copy(struct thread_info *ti, size_t size)
+{
+	char *p;
+
+	switch (alloc_mode) {
+	case ALLOC_POOL:
+		return ti->pool;
+	case ALLOC_ARENA:
+		size = (size + 63) & ~(size_t) 63;
+		if (ti->pool_off + size > ti->pool_size)
+			ti->pool_off = 0;
+		p = ti->pool + ti->pool_off;
+		ti->pool_off += size;
+		return p;
+	default:
+		return sys_alloc(size, alloc_mode == ALLOC_MMAP);
+	}
+}
+
+static void
+free_copy(void *p, size_t size)
+{
+	/* pool and arena memory goes back when the thread exits */
+	if (alloc_mode == ALLOC_MALLOC || alloc_mode == ALLOC_MMAP)
+		sys_free(p, size, alloc_mode == ALLOC_MMAP);
+}
+
 /*
  * Factor out differences in memcpy implementation by optionally using
  * our own simple memcpy implementation.
@@ -320,7 +718,12 @@ allocate(void)
 
 
 	for (i = 0; i < chunks; i++) {
-		mem[i] = (record_t *) alloc_mem(chunk_size);
+		/* mbind wants page aligned chunks */
+		if (numa_mode != NUMA_NONE) {
+			mem[i] = (record_t *) sys_alloc(chunk_size, 1);
+			bind_mem(mem[i], chunk_size, i % nr_nodes);
+		} else
+			mem[i] = (record_t *) alloc_mem(chunk_size);
 		/* Prevent coalescing using holes */
 		if (use_holes)
 			hole_mem[i] = alloc_mem(page_size);
@@ -351,11 +754,11 @@ write_pattern(void)
 		printf("Wrote memory\n");
 }
 
-static void *
-linear_search(record_t key, record_t *base, size_t size)
+static record_t *
+linear_search(record_t key, record_t *base, size_t nr)
 {
 	record_t *p;
-	record_t *end = base + (size / record_size);
+	record_t *end = base + nr;
 
 	for(p = base; p < end; p++)
 		if (*p == key)
@@ -369,6 +772,183 @@ compare(const void *p1, const void *p2)
 	return (* (record_t *) p1 - * (record_t *) p2);
 }
 
+/*
+ * Halve the range without ever branching on the comparison; only the
+ * loop count depends on nr, never on the key.
+ */
+
+static record_t *
+branchless_search(record_t key, record_t *base, size_t nr)
+{
+	size_t half;
+
+	if (nr == 0)
+		return NULL;
+	while (nr > 1) {
+		half = nr / 2;
+		base = (base[half] <= key) ? base + half : base;
+		nr -= half;
+	}
+	return *base == key ? base : NULL;
+}
+
+/*
+ * Lay sorted src out in eytzinger order: the children of dst[k] are
+ * dst[2k+1] and dst[2k+2].  Returns how much of src has been used.
+ */
+
+static size_t
+eytzinger_build(record_t *dst, record_t *src, size_t i, size_t k, size_t nr)
+{
+	if (k < nr) {
+		i = eytzinger_build(dst, src, i, 2 * k + 1, nr);
+		dst[k] = src[i++];
+		i = eytzinger_build(dst, src, i, 2 * k + 2, nr);
+	}
+	return i;
+}
+
+/*
+ * Walk down from the root with k counted from 1, then back out of the
+ * trailing right turns to the last node where we went left: that's the
+ * first record >= key.
+ */
+
+static record_t *
+eytzinger_search(record_t key, record_t *base, size_t nr)
+{
+	unsigned long long k = 1;
+
+	while (k <= nr)
+		k = 2 * k + (base[k - 1] < key);
+	k >>= __builtin_ffsll(~k);
+	if (k == 0 || base[k - 1] != key)
+		return NULL;
+	return &base[k - 1];
+}
+
+typedef record_t record_vec_t __attribute__ ((vector_size (4 * sizeof (record_t))));
+
+static record_t *
+simd_search(record_t key, record_t *base, size_t nr)
+{
+	record_vec_t v;
+	size_t i, j;
+
+	for (i = 0; i + 4 <= nr; i += 4) {
+		memcpy(&v, base + i, sizeof (v));
+		v = (record_vec_t) (v == key);
+		if (v[0] | v[1] | v[2] | v[3])
+			for (j = i; ; j++)
+				if (base[j] == key)
+					return &base[j];
+	}
+	for (; i < nr; i++)
+		if (base[i] == key)
+			return &base[i];
+	return NULL;
+}
+
+static record_t *
+search_records(record_t key, record_t *base, size_t nr)
+{
+	switch (search_mode) {
+	case SEARCH_LINEAR:
+		return linear_search(key, base, nr);
+	case SEARCH_BRANCHLESS:
+		return branchless_search(key, base, nr);
+	case SEARCH_EYTZINGER:
+		return eytzinger_search(key, base, nr);
+	case SEARCH_SIMD:
+		return simd_search(key, base, nr);
+	}
+	return bsearch(&key, base, nr, record_size, compare);
+}
+
+/* Fill the buffer search_records will look in from sorted src */
+static void
+copy_records(record_t *copy, record_t *src, size_t size)
+{
+	if (search_mode == SEARCH_EYTZINGER)
+		eytzinger_build(copy, src, 0, 0, size / record_size);
+	else if (no_lib_memcpy)
+		my_memcpy(copy, src, size);
+	else
+		memcpy(copy, src, size);
+}
+
+/*
+ * Cheap enough to call around every phase of every record, it's a vdso
+ * call on Linux.
+ */
+
+static inline unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int
+lat_bucket(unsigned long long ns)
+{
+	unsigned int msb;
+	unsigned int idx;
+
+	if (ns < LAT_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	idx = ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+		((ns >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+	return idx < LAT_BUCKETS ? idx : LAT_BUCKETS - 1;
+}
+
+/* Middle of the range a bucket covers */
+static unsigned long long
+lat_bucket_val(unsigned int idx)
+{
+	unsigned int group = idx >> LAT_SUB_BITS;
+	unsigned long long base;
+
+	if (group == 0)
+		return idx;
+	base = (unsigned long long) (LAT_SUB + (idx & (LAT_SUB - 1))) << (group - 1);
+	return base + ((1ULL << (group - 1)) >> 1);
+}
+
+static inline void
+add_lat(struct lat_hist *h, unsigned long long ns)
+{
+	h->count[lat_bucket(ns)]++;
+	h->nr++;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/*
+ * per thousand, so 999 is p99.9.  The top bucket's middle can be past
+ * the largest sample, never report more than that.
+ */
+static unsigned long long
+lat_percentile(struct lat_hist *h, unsigned int permille)
+{
+	unsigned long long want = (h->nr * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	unsigned long long val;
+	unsigned int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= want && seen) {
+			val = lat_bucket_val(i);
+			return val < h->max ? val : h->max;
+		}
+	}
+	return h->max;
+}
+
 /*
  * Stupid ranged random number function.  We don't care about quality.
  *
@@ -382,6 +962,179 @@ rand_num(unsigned int max, unsigned int *state)
 	return ((*state/65536) % max);
 }
 
+/*
+ * Make sure the search kernel agrees with bsearch before trusting its
+ * numbers.  Odd records only, so every key below, between and above
+ * them gets tried as a miss too.  Small sizes get every key, the full
+ * chunk gets the edges and a pile of random ones.
+ */
+
+static void
+check_one(record_t *src, record_t *copy, size_t nr, record_t key)
+{
+	record_t *want = bsearch(&key, src, nr, record_size, compare);
+	record_t *got = search_records(key, copy, nr);
+
+	if ((want == NULL) != (got == NULL) || (got && *got != key)) {
+		fprintf(stderr, "%s search of %zu records for key %zu: "
+			"got %s, bsearch %s\n", search_names[search_mode], nr,
+			key, got ? "found" : "missing",
+			want ? "found" : "missing");
+		exit(1);
+	}
+}
+
+static void
+check_search(void)
+{
+	size_t max = chunk_size / record_size;
+	size_t sizes[36];
+	unsigned int nr_sizes = 0;
+	unsigned int state = 0x5eedf00d;
+	record_t *src, *copy, key;
+	size_t i, n;
+	unsigned int s;
+
+	for (n = 1; n <= 33 && n <= max; n++)
+		sizes[nr_sizes++] = n;
+	if (max - 1 > 33)
+		sizes[nr_sizes++] = max - 1;
+	if (max > 33)
+		sizes[nr_sizes++] = max;
+
+	src = malloc(max * record_size);
+	copy = malloc(max * record_size);
+	if (src == NULL || copy == NULL) {
+		fprintf(stderr, "Couldn't allocate search check buffers\n");
+		exit(1);
+	}
+	for (i = 0; i < max; i++)
+		src[i] = 2 * i + 1;
+
+	for (s = 0; s < nr_sizes; s++) {
+		n = sizes[s];
+		copy_records(copy, src, n * record_size);
+		if (n <= 4096) {
+			for (key = 0; key <= 2 * n + 1; key++)
+				check_one(src, copy, n, key);
+		} else {
+			check_one(src, copy, n, 0);
+			check_one(src, copy, n, 1);
+			check_one(src, copy, n, 2 * n - 1);
+			check_one(src, copy, n, 2 * n);
+			for (i = 0; i < 4096; i++) {
+				key = ((record_t) rand_num(1 << 16, &state) << 16 |
+				       rand_num(1 << 16, &state)) % (2 * n + 2);
+				check_one(src, copy, n, key);
+			}
+		}
+		check_one(src, copy, n, (record_t) -1);
+	}
+
+	free(src);
+	free(copy);
+	if (verbose)
+		printf("%s search agrees with bsearch\n", search_names[search_mode]);
+}
+
+/*
+ * -ln(u) for u in (0, 1], for Poisson gaps without dragging in libm.
+ * Scale into [0.5, 1) and use ln(x) = 2 atanh((x - 1) / (x + 1)), which
+ * converges fast that close to 1.
+ */
+
+static double
+neg_log(double u)
+{
+	double s, s2, term, sum = 0;
+	unsigned int k = 0, n;
+
+	while (u < 0.5) {
+		u *= 2;
+		k++;
+	}
+	s = (u - 1) / (u + 1);
+	s2 = s * s;
+	term = s;
+	for (n = 1; n < 32; n += 2) {
+		sum += term / n;
+		term *= s2;
+	}
+	return k * 0.69314718055994530942 - 2 * sum;
+}
+
+/* Nanoseconds to the next -r arrival */
+static unsigned long long
+next_gap(struct thread_info *ti)
+{
+	unsigned long long mean = 1000000000ULL / rate;
+
+	if (arrival_mode == ARRIVAL_PERIODIC)
+		return mean;
+	/* xorshift64, rand_num only has 16 bits to give */
+	ti->rng ^= ti->rng << 13;
+	ti->rng ^= ti->rng >> 7;
+	ti->rng ^= ti->rng << 17;
+	return mean * neg_log(((ti->rng >> 11) + 1) / 9007199254740992.0);
+}
+
+static void
+sleep_until(struct thread_info *ti, unsigned long long deadline)
+{
+	struct timespec ts;
+	unsigned long long now;
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	now = now_ns();
+	add_lat(ti->wake, now > deadline ? now - deadline : 0);
+}
+
+/*
+ * Called before every record.  -u keeps working until busy_until and
+ * then sleeps to the end of the period; a period we ran right through
+ * starts the next one from now.  -r sleeps to the next arrival unless
+ * it's already due, in which case it's counted and we keep going.
+ */
+
+static void
+pace(struct thread_info *ti)
+{
+	unsigned long long period = period_us * 1000ULL;
+	unsigned long long now;
+
+	if (util_pct) {
+		if (now_ns() < ti->busy_until)
+			return;
+		ti->deadline += period;
+		now = now_ns();
+		if (now < ti->deadline)
+			sleep_until(ti, ti->deadline);
+		else {
+			ti->overruns++;
+			ti->deadline = now;
+		}
+		ti->busy_until = ti->deadline + period * util_pct / 100;
+	} else if (rate) {
+		ti->deadline += next_gap(ti);
+		if (now_ns() < ti->deadline)
+			sleep_until(ti, ti->deadline);
+		else
+			ti->overruns++;
+	}
+}
+
+static unsigned long long
+thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /*
  * This function is the meat of the program; the rest is just support.
  *
@@ -390,13 +1143,14 @@ rand_num(unsigned int max, unsigned int *state)
  * then free the memory.  An option tells us to allocate and copy a
  * randomly sized chunk of the memory instead of the whole thing.
  *
- * Linear search provided for sanity checking.
+ * Linear search provided for sanity checking, -f picks other kernels.
  *
  */
 
 static unsigned int
-search_mem(void)
+search_mem(struct thread_info *ti)
 {
+	struct thread_lat *lat = ti->lat;
 	record_t key, *found;
 	record_t *src, *copy;
 	unsigned int chunk;
@@ -406,6 +1160,8 @@ search_mem(void)
         unsigned int sleep_at_part;
         unsigned int sleep_interval_part;
         int hvnt_slept = 1;
+	unsigned long long t0 = 0, t1 = 0;
+	unsigned long long cpu_start, wall_start;
         struct timeval tv;
         gettimeofday(&tv,NULL);
         
@@ -418,8 +1174,17 @@ search_mem(void)
                 printf("Sleep Interval: %d Sleep Interval Part: %d\n",sleep_interval,sleep_interval_part);
         }
 
+	cpu_start = thread_cpu_ns();
+	wall_start = now_ns();
+	ti->deadline = wall_start;
+	ti->busy_until = wall_start + period_us * 1000ULL * util_pct / 100;
+
 	for (i = 0; threads_go == 1; i++) {
-		chunk = rand_num(chunks, &state);
+		pace(ti);
+		if (ti->nr_slice)
+			chunk = rand_num(ti->nr_slice, &state) * nr_nodes + ti->slice;
+		else
+			chunk = rand_num(chunks, &state);
 		src = mem[chunk];
 		/*
 		 * If we're doing random sizes, we need a non-zero
@@ -428,35 +1193,50 @@ search_mem(void)
 		if (random_size)
 			copy_size = (rand_num(chunk_size / record_size, &state)
 				     + 1) * record_size;
-		copy = alloc_mem(copy_size);
+		if (lat)
+			t0 = now_ns();
+		copy = alloc_copy(ti, copy_size);
+		if (lat) {
+			t1 = now_ns();
+			add_lat(&lat->phase[PHASE_ALLOC], t1 - t0);
+		}
 
 		if ( touch_pages ) {
 			touch_mem((char *) copy, copy_size);
+			if (lat) {
+				t0 = now_ns();
+				add_lat(&lat->phase[PHASE_COPY], t0 - t1);
+			}
 		} else {
 		
-			if (no_lib_memcpy)
-				my_memcpy(copy, src, copy_size);
-			else
-				memcpy(copy, src, copy_size);
+			copy_records(copy, src, copy_size);
+			if (lat) {
+				t0 = now_ns();
+				add_lat(&lat->phase[PHASE_COPY], t0 - t1);
+			}
 
 			key = rand_num(copy_size / record_size, &state);
 
 			if (verbose > 2)
 				printf("[%lx]Search key %zu, copy size %zu\n", pthread_self(), key, copy_size);
-			if (linear)
-				found = linear_search(key, copy, copy_size);
-			else
-				found = bsearch(&key, copy, copy_size / record_size,
-					record_size, compare);
+			found = search_records(key, copy, copy_size / record_size);
 	
 				/* Below check is mainly for memory corruption or other bug */
 			if (found == NULL) {
 				fprintf(stderr, "Couldn't find key %zd\n", key);
 				exit(1);
 			}
+			if (lat) {
+				t1 = now_ns();
+				add_lat(&lat->phase[PHASE_SEARCH], t1 - t0);
+				t0 = t1;
+			}
 		} /* end if ! touch_pages */
 
-		free_mem(copy, copy_size);
+		free_copy(copy, copy_size);
+		ti->copied += copy_size;
+		if (lat)
+			add_lat(&lat->phase[PHASE_FREE], now_ns() - t0);
 		//if (sleep_at && !(i % sleep_at))
 		//	usleep(sleep_interval);
                 if(sleep_at && !(i % sleep_at_part) && hvnt_slept){
@@ -469,22 +1249,38 @@ search_mem(void)
                 }
 	}
 
+	ti->cpu_ns = thread_cpu_ns() - cpu_start;
+	ti->wall_ns = now_ns() - wall_start;
 	return (i);
 }
 
 static void *
 thread_run(void *arg)
 {
-
+	struct thread_info *ti = arg;
 	unsigned int records_local;
+
 	if (verbose > 1)
 		printf("[%lx]Thread started\n", pthread_self());
 
+	if (numa_mode != NUMA_NONE)
+		pin_thread(ti);
+	setup_copy_pool(ti);
+
+	/* Pool and arena are faulted in, don't let that count */
+	pthread_mutex_lock(&records_count_lock);
+	threads_ready++;
+	pthread_mutex_unlock(&records_count_lock);
+
 	/* Wait for the start signal */
 
 	while (threads_go == 0);
 
-	records_local = search_mem();
+	records_local = search_mem(ti);
+	ti->records = records_local;
+
+	if (ti->pool)
+		free_mem(ti->pool, ti->pool_size);
 
 	pthread_mutex_lock(&records_count_lock);
 	records_read += records_local;
@@ -506,10 +1302,99 @@ difftimeval(struct timeval *end, struct timeval *start)
 	return diff;
 }
 
+static void
+print_phase_lat(struct thread_lat *lat)
+{
+	struct lat_hist total;
+	struct lat_hist *h;
+	unsigned int t, p, i;
+
+	printf("phase  %12s %12s %12s %12s (usec)\n", "p50", "p99", "p99.9", "max");
+	for (p = 0; p < NR_PHASES; p++) {
+		memset(&total, 0, sizeof(total));
+		for (t = 0; t < threads; t++) {
+			h = &lat[t].phase[p];
+			for (i = 0; i < LAT_BUCKETS; i++)
+				total.count[i] += h->count[i];
+			total.nr += h->nr;
+			if (h->max > total.max)
+				total.max = h->max;
+		}
+		if (!total.nr)
+			continue;
+		printf("%-6s %12.3f %12.3f %12.3f %12.3f\n", phase_names[p],
+		       lat_percentile(&total, 500) / 1000.0,
+		       lat_percentile(&total, 990) / 1000.0,
+		       lat_percentile(&total, 999) / 1000.0,
+		       total.max / 1000.0);
+	}
+}
+
+static void
+print_node_stats(struct thread_info *info, double elapsed)
+{
+	unsigned long long records, copied;
+	unsigned int i;
+	int node;
+
+	for (node = 0; node < nr_nodes; node++) {
+		records = 0;
+		copied = 0;
+		for (i = 0; i < threads; i++) {
+			if (info[i].node != node)
+				continue;
+			records += info[i].records;
+			copied += info[i].copied;
+		}
+		printf("node %d: %u records/s %.1f MB/s copied\n", node_ids[node],
+		       (unsigned int) (records / elapsed),
+		       copied / elapsed / (1024 * 1024));
+	}
+}
+
+static void
+print_pace_stats(struct thread_info *info)
+{
+	struct lat_hist total;
+	unsigned long long cpu = 0, wall = 0, overruns = 0;
+	unsigned int t, i;
+
+	memset(&total, 0, sizeof(total));
+	for (t = 0; t < threads; t++) {
+		cpu += info[t].cpu_ns;
+		wall += info[t].wall_ns;
+		overruns += info[t].overruns;
+		for (i = 0; i < LAT_BUCKETS; i++)
+			total.count[i] += info[t].wake->count[i];
+		total.nr += info[t].wake->nr;
+		if (info[t].wake->max > total.max)
+			total.max = info[t].wake->max;
+	}
+
+	if (util_pct)
+		printf("util %5.1f%% target %u%%, %llu periods overrun\n",
+		       wall ? 100.0 * cpu / wall : 0.0, util_pct, overruns);
+	else
+		printf("util %5.1f%%, %llu arrivals already due\n",
+		       wall ? 100.0 * cpu / wall : 0.0, overruns);
+	if (!total.nr)
+		return;
+	printf("wakeup %12s %12s %12s %12s (usec late, %llu wakeups)\n",
+	       "p50", "p99", "p99.9", "max", total.nr);
+	printf("%-6s %12.3f %12.3f %12.3f %12.3f\n", "",
+	       lat_percentile(&total, 500) / 1000.0,
+	       lat_percentile(&total, 990) / 1000.0,
+	       lat_percentile(&total, 999) / 1000.0,
+	       total.max / 1000.0);
+}
+
 static void
 start_threads(void)
 {
 	pthread_t thread_array[threads];
+	struct thread_info info[threads];
+	struct thread_lat *lat = NULL;
+	struct lat_hist *wake = NULL;
 	double elapsed;
 	unsigned int i;
 	struct rusage start_ru, end_ru;
@@ -519,14 +1404,46 @@ start_threads(void)
 	if (verbose)
 		printf("Threads starting\n");
 
+	if (phase_lat) {
+		lat = calloc(threads, sizeof(*lat));
+		if (lat == NULL) {
+			fprintf(stderr, "Couldn't allocate latency histograms\n");
+			exit(1);
+		}
+	}
+
+	if (util_pct || rate) {
+		wake = calloc(threads, sizeof(*wake));
+		if (wake == NULL) {
+			fprintf(stderr, "Couldn't allocate wakeup histograms\n");
+			exit(1);
+		}
+	}
+
+	memset(info, 0, sizeof(info));
 	for (i = 0; i < threads; i++) {
-		err = pthread_create(&thread_array[i], NULL, thread_run, NULL);
+		info[i].lat = lat ? &lat[i] : NULL;
+		info[i].wake = wake ? &wake[i] : NULL;
+		info[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+		info[i].node = i % nr_nodes;
+		if (numa_mode == NUMA_LOCAL || numa_mode == NUMA_REMOTE) {
+			info[i].slice = info[i].node;
+			if (numa_mode == NUMA_REMOTE)
+				info[i].slice = (info[i].node + 1) % nr_nodes;
+			info[i].nr_slice = (chunks - info[i].slice + nr_nodes - 1) /
+				nr_nodes;
+		}
+		err = pthread_create(&thread_array[i], NULL, thread_run,
+				     &info[i]);
 		if (err) {
 			fprintf(stderr, "Error creating thread %d\n", i);
 			exit(1);
 		}
 	}
 
+	while (threads_ready < threads)
+		usleep(1000);
+
 	/*
 	 * Begin accounting - this is when we actually do the things
 	 * we want to measure. */
@@ -563,6 +1480,19 @@ start_threads(void)
 	printf("real %5.2f s\n", elapsed);
 	printf("user %5.2f s\n", usr_time.tv_sec + usr_time.tv_usec/1e6);
 	printf("sys  %5.2f s\n", sys_time.tv_sec + sys_time.tv_usec/1e6);
+
+	if (numa_mode != NUMA_NONE)
+		print_node_stats(info, elapsed);
+
+	if (wake) {
+		print_pace_stats(info);
+		free(wake);
+	}
+
+	if (lat) {
+		print_phase_lat(lat);
+		free(lat);
+	}
 }
 
 int
@@ -570,6 +1500,12 @@ main(int argc, char *argv[])
 {
 	read_options(argc, argv);
 
+	if (numa_mode != NUMA_NONE)
+		read_nodes();
+
+	if (search_mode != SEARCH_BSEARCH)
+		check_search();
+
 	allocate();
 
 	write_pattern();
@@ -29,6 +29,18 @@
 #define _SC_NPROCESSORS_ONLN pthread_num_processors_np()
 #endif
 
+/*
+ * Linux NUMA placement, straight syscalls so we don't need libnuma
+ */
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#define HAVE_NUMA
+#ifndef MPOL_BIND
+#define MPOL_BIND	2
+#endif
+#endif
+
 
 
 #endif /* EBIZZY_H */
@@ -60,6 +60,40 @@
     It should also respond to Ctrl-C to exit if it is not completing the
     process.
 
+    Fiber mode:
+
+        ./dwh --minthreads 100000 --iothreads 50 --fibers --schedthreads 8
+            --maxmem 4G --maxiosize 64k dwh.test
+
+    With --fibers the worker threads are not pthreads. Each worker is a
+    stackful fiber (ucontext) with a small private stack (--fiberstack,
+    default 64k) and the fibers are multiplexed over --schedthreads OS
+    threads (default one per online CPU). Every scheduler thread has its
+    own run queue and steals from the others when it runs dry. Worker
+    sleeps park the fiber on a per-scheduler timer heap and I/O
+    completions resume the waiting fiber directly, so the OS thread is
+    never blocked by a worker. I/O threads stay as pthreads. Leave
+    --fibers off to keep one kernel thread per worker for scheduler
+    stress testing.
+
+        ./dwh --fibertest --schedthreads 8
+
+    checks that fibers woken before their timeout are freed only once
+    their stale timers have fired, then exits (non-zero on failure).
+
+    Record/replay:
+
+        ./dwh --minthreads 500 --iothreads 50 --time 60 --record run.trc dwh.test
+        ./dwh --minthreads 500 --iothreads 50 --time 60 --replay run.trc dwh.test
+
+    Activities, sizes and file offsets are normally random and time seeded
+    so no two runs match. --record writes each worker's activity sequence
+    to a binary trace and --replay re-runs it, each worker (by thread
+    number) following its own part of the trace at the recorded times.
+    Replay starts exactly the recorded workers, replacements at the time
+    they were started, instead of starting replacements at random.
+    Use the same thread, memory and I/O size settings for both runs.
+
 */
 
 #include <stdbool.h>
@@ -67,6 +101,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
 #include <cstdlib>
 #include <string>
 #include <getopt.h>
@@ -80,6 +115,16 @@
 #include <signal.h>
 #include <atomic>
 #include <time.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <new>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <algorithm>
 
 bool Diagnose = false;
 
@@ -145,6 +190,19 @@ static int verbose_flag = 0;
 static int short_threads = 1;
 #define RESTART_SCOPE (RAND_MAX / 800)
 
+/* Flag set by '--fibers' (assume one pthread per worker) */
+static int fiber_mode = 0;
+
+/* Flag set by '--fibertest' (check the fiber engine and exit) */
+static int fiber_test = 0;
+
+/* Flag set by '--perf' (count cycles/instructions/LLC misses per activity) */
+static int perf_flag = 0;
+
+/* Fiber mode scheduler threads and per-fiber stack size */
+unsigned int schedthreads = 0;
+unsigned long long fiberStackSize = 64 * 1024;
+
 /* I/O filename/stream */
 unsigned long long fileSize = 0;
 std::string ioFilename;
@@ -180,6 +238,15 @@ struct option long_options[] = {
         {"maxthreads", required_argument, 0, 'x'},
         {"maxiosize", required_argument, 0, 'S'},
         {"time", required_argument, 0, 't'},
+        {"fibers", no_argument, &fiber_mode, 1},
+        {"fibertest", no_argument, &fiber_test, 1},
+        {"perf", no_argument, &perf_flag, 1},
+        {"alloc", required_argument, 0, 'A'},
+        {"hugepool", required_argument, 0, 'P'},
+        {"schedthreads", required_argument, 0, 'T'},
+        {"fiberstack", required_argument, 0, 'K'},
+        {"record", required_argument, 0, 'R'},
+        {"replay", required_argument, 0, 'Y'},
         {0, 0, 0, 0}
     };
 
@@ -189,9 +256,10 @@ struct thread_info {    /* Used as argument to thread_start() */
            sem_t     my_sem;           /* Application-defined semaphore */
            int       my_fd;            /* Thread specific file descriptor */
            char     *argv_string;      /* From command-line argument */
+           bool      initial;          /* Started at launch, not as a replacement */
     };
 
-struct io_queue_node {
+struct io_queue_node {   /* Lives in a worker's pool, one per cacheline */
         struct io_queue_node *prev;
         struct io_queue_node *next;
         sem_t  *my_sem;           /* Application-defined semaphore */
@@ -199,7 +267,10 @@ struct io_queue_node {
         void *io_buffer;
         unsigned int io_len;
         unsigned int io_done;
-    };
+        long long io_pos;         /* File offset, -1 lets the I/O thread pick */
+        struct fiber *my_fiber;   /* Waiting worker fiber (fiber mode only) */
+        bool    in_use;           /* Taken from the owning worker's pool */
+    } __attribute__((aligned(64)));
 
 struct io_queue_node *io_readQHead = NULL;
 struct io_queue_node *io_readQTail = NULL;
@@ -229,6 +300,16 @@ void ShowHelp(void)
     printf("  -m, --maxmem <num>      Set a maximum amount of memory to use\n");
     printf("  -S, --maxiosize <num>   Set a maximum memory to use for I/O tasks (default 1M)\n");
     printf("  -t, --time <num>        How long (seconds) program should run for (default 20)\n");
+    printf("      --fibers            Run workers as fibers over a fixed set of OS threads\n");
+    printf("      --schedthreads <num> OS threads to run fibers on (default online CPUs)\n");
+    printf("      --fiberstack <num>  Stack size of each worker fiber (default 64k)\n");
+    printf("      --fibertest         Check fiber wakeups against their timeouts and exit\n");
+    printf("      --alloc <type>      Worker buffer backend: calloc (default), thp or hugetlb\n");
+    printf("      --hugepool <num>    Bytes (k/M/G) of huge pages to reserve for --alloc\n");
+    printf("                          hugetlb (default one max I/O size buffer per worker)\n");
+    printf("      --perf              Report cycles, IPC and LLC misses per activity\n");
+    printf("      --record <file>     Write every worker's activity sequence to a trace\n");
+    printf("      --replay <file>     Re-run the activity sequence of a --record trace\n");
     printf("      --verbose           Show more information while running\n");
     printf("      --brief             Show limited information while running\n");
     printf("  --help                  Show program information\n");
@@ -282,6 +363,338 @@ void CountingFree(void *mem)
     }
 }
 
+/*
+ * Worker buffer backends (--alloc)
+ *
+ * calloc   CountingCalloc(), the default
+ * thp      private anonymous mmap with MADV_HUGEPAGE, rounded up to whole
+ *          huge pages and huge page aligned so every buffer can be backed
+ *          by huge pages (at the cost of a huge page per small buffer)
+ * hugetlb  fixed size slots carved out of one MAP_HUGETLB pool reserved
+ *          at start (--hugepool, needs vm.nr_hugepages), so even small
+ *          buffers share huge pages
+ *
+ * All backends charge memUsed like CountingCalloc() so --maxmem applies.
+ * mmap'd buffers keep their size in a cacheline sized header so the data
+ * itself stays cacheline aligned.
+ */
+#define ALLOC_CALLOC  0
+#define ALLOC_THP     1
+#define ALLOC_HUGETLB 2
+
+#define WKBUF_HDR 64
+
+int allocBackend = ALLOC_CALLOC;
+const char *allocNames[] = { "calloc", "thp", "hugetlb" };
+unsigned long long hugePoolSize = 0;
+unsigned long long hugePageSize = 2 * 1024 * 1024;
+
+/* hugetlb pool: slots handed out from a free stack */
+char *hugePool = NULL;
+unsigned long long hugePoolLen = 0;
+unsigned long long hugeSlotSize = 0;
+unsigned int *hugeFreeSlots = NULL;
+unsigned int hugeFreeTop = 0;
+pthread_mutex_t hugepoollock = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<unsigned long long> nHugePoolEmpty(0);
+
+/* Hugepagesize from /proc/meminfo, 2MiB if it can't be read */
+unsigned long long getHugePageSize(void)
+{
+    FILE *f;
+    char line[128];
+    unsigned long long kb = 0;
+
+    f = fopen("/proc/meminfo", "r");
+    if (f != NULL)
+    {
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            if (sscanf(line, "Hugepagesize: %llu kB", &kb) == 1)
+                break;
+        }
+        fclose(f);
+    }
+    if (kb == 0)
+        return 2 * 1024 * 1024;
+
+    return kb * 1024;
+}
+
+bool SetupWorkerMem(void)
+{
+    unsigned long long nSlots, i;
+
+    if (allocBackend == ALLOC_CALLOC)
+        return true;
+
+    hugePageSize = getHugePageSize();
+    if (allocBackend != ALLOC_HUGETLB)
+        return true;
+
+    hugeSlotSize = ((maxIOSize + WKBUF_HDR + 63) / 64) * 64;
+    if (hugePoolSize == 0)
+    {
+        /* Enough for every worker to hold a maximum sized buffer */
+        hugePoolSize = hugeSlotSize * (maxthreads - iothreads);
+        if ((maxMem != 0) && (hugePoolSize > maxMem))
+            hugePoolSize = maxMem;
+    }
+    hugePoolLen = ((hugePoolSize + hugePageSize - 1) / hugePageSize) * hugePageSize;
+    nSlots = hugePoolLen / hugeSlotSize;
+    if (nSlots == 0)
+    {
+        printf("Huge page pool (%llu) is smaller than one buffer (%llu)\n", hugePoolLen, hugeSlotSize);
+        return false;
+    }
+
+    hugePool = (char *)mmap(NULL, hugePoolLen, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (hugePool == MAP_FAILED)
+    {
+        hugePool = NULL;
+        printf("Failed to reserve %llu bytes of huge pages (%d), check /proc/sys/vm/nr_hugepages\n",
+               hugePoolLen, errno);
+        return false;
+    }
+
+    hugeFreeSlots = (unsigned int *)calloc(nSlots, sizeof(*hugeFreeSlots));
+    if (hugeFreeSlots == NULL)
+    {
+        munmap(hugePool, hugePoolLen);
+        hugePool = NULL;
+        return false;
+    }
+    for (i = 0; i < nSlots; i++)
+        hugeFreeSlots[i] = nSlots - 1 - i;
+    hugeFreeTop = nSlots;
+
+    printf("Huge page pool: %llu slots of %llu bytes in %llu bytes of %llu byte pages\n",
+           nSlots, hugeSlotSize, hugePoolLen, hugePageSize);
+
+    return true;
+}
+
+void CleanupWorkerMem(void)
+{
+    if (hugePool != NULL)
+    {
+        munmap(hugePool, hugePoolLen);
+        hugePool = NULL;
+    }
+    free(hugeFreeSlots);
+    hugeFreeSlots = NULL;
+    hugeFreeTop = 0;
+}
+
+void *WorkerMemAlloc(unsigned long long sz)
+{
+    unsigned long long len;
+    unsigned long long *hdr = NULL;
+    unsigned int slot;
+    char *map, *start;
+
+    if (allocBackend == ALLOC_CALLOC)
+        return CountingCalloc(1, sz);
+
+    memUsed += sz;
+    if ((maxMem > 0) && (memUsed > maxMem))
+    {
+        memUsed -= sz;
+        return NULL;
+    }
+
+    if (allocBackend == ALLOC_THP)
+    {
+        /*
+         * Whole, aligned huge pages or the kernel can't back any of it
+         * with one: over-map by a huge page and trim both ends.
+         */
+        len = ((sz + WKBUF_HDR + hugePageSize - 1) / hugePageSize) * hugePageSize;
+        map = (char *)mmap(NULL, len + hugePageSize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map != MAP_FAILED)
+        {
+            start = (char *)((((uintptr_t)map) + hugePageSize - 1) & ~((uintptr_t)hugePageSize - 1));
+            if (start > map)
+                munmap(map, start - map);
+            if (start + len < map + len + hugePageSize)
+                munmap(start + len, (map + hugePageSize) - start);
+            (void)madvise(start, len, MADV_HUGEPAGE);
+            hdr = (unsigned long long *)start;
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&hugepoollock);
+        if (hugeFreeTop > 0)
+        {
+            slot = hugeFreeSlots[--hugeFreeTop];
+            hdr = (unsigned long long *)(hugePool + (slot * hugeSlotSize));
+        }
+        pthread_mutex_unlock(&hugepoollock);
+        if (hdr == NULL)
+            nHugePoolEmpty++;
+        len = hugeSlotSize;
+    }
+
+    if (hdr == NULL)
+    {
+        memUsed -= sz;
+        return NULL;
+    }
+    hdr[0] = sz;
+    hdr[1] = len;
+
+    return (char *)hdr + WKBUF_HDR;
+}
+
+void WorkerMemFree(void *mem)
+{
+    unsigned long long *hdr;
+    unsigned int slot;
+
+    if (allocBackend == ALLOC_CALLOC)
+    {
+        CountingFree(mem);
+        return;
+    }
+    if (mem == NULL)
+        return;
+
+    hdr = (unsigned long long *)((char *)mem - WKBUF_HDR);
+    memUsed -= hdr[0];
+    if (allocBackend == ALLOC_THP)
+    {
+        munmap(hdr, hdr[1]);
+        return;
+    }
+
+    /* Slot contents are not cleared on reuse, nothing depends on them */
+    slot = ((char *)hdr - hugePool) / hugeSlotSize;
+    pthread_mutex_lock(&hugepoollock);
+    hugeFreeSlots[hugeFreeTop++] = slot;
+    pthread_mutex_unlock(&hugepoollock);
+}
+
+/*
+ * Per-worker I/O node pools
+ *
+ * A worker only ever has one request in flight, so each worker slot gets
+ * one cacheline aligned io_queue_node on its first thread start and
+ * submit/complete just flip in_use. If --maxmem refuses it the worker
+ * tries again on its next submit, each failed try counts as the pool
+ * being empty. The nodes are kept for replacement threads in the same
+ * slot and are only released once the I/O queues have been cleared at
+ * exit, as nodes abandoned at shutdown may still be linked on them.
+ */
+#define IO_NODE_SLOTS 1
+
+struct io_queue_node **ioNodePools = NULL;
+unsigned int nIONodePools = 0;
+std::atomic<unsigned long long> nIONodePoolEmpty(0);
+
+/* CountingCalloc() for cacheline aligned blocks */
+void *CountingAlignedCalloc(size_t nmem, size_t size)
+{
+    unsigned long long sz;
+    void *mem;
+
+    sz = nmem * size;
+    memUsed += sz;
+    if ((maxMem > 0) && (memUsed > maxMem))
+    {
+        memUsed -= sz;
+        return NULL;
+    }
+    if (posix_memalign(&mem, 64, sz + 64) != 0)
+    {
+        memUsed -= sz;
+        return NULL;
+    }
+    memset(mem, 0, sz + 64);
+    ((unsigned long long *)mem)[7] = sz;
+
+    return (char *)mem + 64;
+}
+
+void CountingAlignedFree(void *mem)
+{
+    unsigned long long *pSz;
+
+    if (mem != NULL)
+    {
+        pSz = (unsigned long long *)((char *)mem - 64);
+        memUsed -= pSz[7];
+        free(pSz);
+    }
+}
+
+bool SetupIONodePools(unsigned int nWorkers)
+{
+    ioNodePools = (struct io_queue_node **)CountingCalloc(nWorkers, sizeof(*ioNodePools));
+    if (ioNodePools == NULL)
+        return false;
+    nIONodePools = nWorkers;
+
+    return true;
+}
+
+/* Called at worker start and on submit until it works, the pool survives the thread */
+struct io_queue_node *getIONodePool(unsigned int wNum)
+{
+    if ((ioNodePools == NULL) || (wNum >= nIONodePools))
+        return NULL;
+    if (ioNodePools[wNum] == NULL)
+        ioNodePools[wNum] = (struct io_queue_node *)CountingAlignedCalloc(IO_NODE_SLOTS,
+                                                                        sizeof(struct io_queue_node));
+
+    return ioNodePools[wNum];
+}
+
+struct io_queue_node *getPoolIONode(struct io_queue_node *pool)
+{
+    int n;
+
+    if (pool != NULL)
+    {
+        for (n = 0; n < IO_NODE_SLOTS; n++)
+        {
+            if (!pool[n].in_use)
+            {
+                pool[n].in_use = true;
+                pool[n].prev = NULL;
+                pool[n].next = NULL;
+                pool[n].io_done = 0;
+                pool[n].io_pos = -1;
+                return &pool[n];
+            }
+        }
+    }
+    nIONodePoolEmpty++;
+
+    return NULL;
+}
+
+void putPoolIONode(struct io_queue_node *node)
+{
+    if (node != NULL)
+        node->in_use = false;
+}
+
+void FreeIONodePools(void)
+{
+    unsigned int n;
+
+    if (ioNodePools == NULL)
+        return;
+    for (n = 0; n < nIONodePools; n++)
+        CountingAlignedFree(ioNodePools[n]);
+    CountingFree(ioNodePools);
+    ioNodePools = NULL;
+    nIONodePools = 0;
+}
+
 int getActivity(unsigned nActivities, int noise)
 {
     unsigned s;
@@ -394,63 +807,644 @@ bool doubleToScale(double *x, char *scale)
     return result;
 }
 
-bool VerifySettings()
+/*
+ * Per-activity accounting
+ *
+ * Every activity is timed and charged with the bytes it touched, which
+ * gives per-activity bandwidth over the time actually spent in it. With
+ * --perf each OS thread also opens one perf_event group (cycles,
+ * instructions, LLC misses and context switches; the first that opens
+ * leads) on first use and reads the whole group with a single read()
+ * before and after every activity. Everything is summed into thread
+ * local totals and only folded into the global per-activity totals when
+ * a thread ends, so the hot path never touches shared cachelines.
+ */
+#define PERF_EV_CYCLES  0
+#define PERF_EV_INSTR   1
+#define PERF_EV_LLCMISS 2
+#define PERF_EV_CSW     3
+#define PERF_EV_NR      4
+
+/*
+ * Attribution slots: worker cases 0-6, worker idle, I/O thread read/write
+ * and worker passes that found nothing to do (e.g. free with no buffer)
+ */
+#define ACT_WK_IDLE   7
+#define ACT_IO_READ   8
+#define ACT_IO_WRITE  9
+#define ACT_WK_SKIP   10
+#define ACT_NR        11
+
+const char *actNames[ACT_NR] = {
+        "alloc", "free", "memset", "memscan", "endcheck",
+        "sigwait", "iosubmit", "idle", "ioread", "iowrite", "skipped"
+    };
+
+struct perf_group {
+        bool tried;
+        int nr;                   /* Events that opened, in group read order */
+        int leader;
+        int ev[PERF_EV_NR];       /* Group read position of each event, or -1 */
+        int fd[PERF_EV_NR];       /* Open events in read order, fd[0] is the leader */
+    };
+
+struct act_sample {
+        struct timespec start;
+        struct perf_group *g;     /* NULL when no counters were read */
+        unsigned long long v[PERF_EV_NR];
+    };
+
+struct act_counts {
+        unsigned long long count;
+        unsigned long long bytes;
+        unsigned long long ns;
+        unsigned long long ev[PERF_EV_NR];
+    };
+
+std::atomic<unsigned long long> actCount[ACT_NR];
+std::atomic<unsigned long long> actBytes[ACT_NR];
+std::atomic<unsigned long long> actNs[ACT_NR];
+std::atomic<unsigned long long> actEvents[ACT_NR][PERF_EV_NR];
+std::atomic<int> nPerfOpenFails(0);
+
+static thread_local struct perf_group myPerf;
+static thread_local struct act_counts myActCounts[ACT_NR];
+
+int perfEventOpen(struct perf_event_attr *attr, int group_fd)
 {
-    /* We must have threads */
-    if (minthreads == 0)
+    attr->size = sizeof(*attr);
+    return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+/* Open this thread's counter group, returns false if counting is unavailable */
+bool PerfThreadOpen(struct perf_group *g)
+{
+    struct perf_event_attr attr;
+    unsigned int types[PERF_EV_NR] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+        };
+    unsigned long long configs[PERF_EV_NR] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES
+        };
+    int e, fd, excludeKernel;
+
+    g->tried = true;
+    g->nr = 0;
+    g->leader = -1;
+    for (e = 0; e < PERF_EV_NR; e++)
+        g->ev[e] = -1;
+
+    /* Retry user space only if the kernel refuses to count kernel mode */
+    for (excludeKernel = 0; (excludeKernel < 2) && (g->leader == -1); excludeKernel++)
     {
-        printf("Not enough threads (%d), use --minthreads <num>\n", minthreads);
-        return false;
+        for (e = 0; e < PERF_EV_NR; e++)
+        {
+            memset(&attr, 0, sizeof(attr));
+            attr.type = types[e];
+            attr.config = configs[e];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = excludeKernel;
+            attr.exclude_hv = 1;
+            /* Missing events (e.g. no PMU in a VM) are reported as zero */
+            fd = perfEventOpen(&attr, g->leader);
+            if (fd == -1)
+                continue;
+            if (g->leader == -1)
+                g->leader = fd;
+            g->fd[g->nr] = fd;
+            g->ev[e] = g->nr++;
+        }
     }
-    /* Max threads can't be lower than min threads */
-    if (minthreads > maxthreads)
+
+    if (g->leader == -1)
     {
-        printf("Max threads (%d) must be greater than or equal to Min threads (%d), use --maxthreads <num>\n", 
-               maxthreads, minthreads);
+        if (nPerfOpenFails++ == 0)
+            printf("perf_event_open failed (%d), hardware counters disabled\n", errno);
         return false;
     }
-    /* I/O threads come from all threads and must leave some */
-    if (iothreads >= minthreads)
-    {
-        printf("I/O threads (%d) must be less than Min Threads (%d), use --iothreads <num>\n", 
-               iothreads, minthreads);
+
+    return true;
+}
+
+__attribute__((noinline)) bool PerfRead(struct act_sample *as)
+{
+    unsigned long long buf[1 + PERF_EV_NR];
+    int e;
+
+    as->g = &myPerf;
+    if (!as->g->tried)
+        (void)PerfThreadOpen(as->g);
+    if (as->g->leader == -1)
         return false;
-    }
-    /* Time must be greater than zero */
-    if (maxruntime < 1)
-    {
-        printf("Runtime (--time <num>) must be greater than zero (%u)\n", 
-               maxruntime);
+
+    if (read(as->g->leader, buf, sizeof(buf)) < (ssize_t)(sizeof(buf[0]) * (1 + as->g->nr)))
         return false;
-    }
-    /* There must be an I/O filename target */
-    if (ioFilename.length() < 1)
+    for (e = 0; e < PERF_EV_NR; e++)
+        as->v[e] = (as->g->ev[e] >= 0) ? buf[1 + as->g->ev[e]] : 0;
+
+    return true;
+}
+
+void ActivityBegin(struct act_sample *as)
+{
+    as->g = NULL;
+    if (perf_flag && !PerfRead(as))
+        as->g = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &as->start);
+}
+
+/* Charge the time, bytes and counter deltas since ActivityBegin() to an activity */
+void ActivityEnd(struct act_sample *as, int act, unsigned long long bytes)
+{
+    struct act_sample now;
+    struct act_counts *ac = &myActCounts[act];
+    int e;
+
+    clock_gettime(CLOCK_MONOTONIC, &now.start);
+    ac->count++;
+    ac->bytes += bytes;
+    ac->ns += ((now.start.tv_sec - as->start.tv_sec) * 1000000000ULL)
+               + now.start.tv_nsec - as->start.tv_nsec;
+
+    if ((as->g == NULL) || !PerfRead(&now))
+        return;
+    /* A fiber that moved to another OS thread has readings from two groups */
+    if (now.g != as->g)
+        return;
+    for (e = 0; e < PERF_EV_NR; e++)
+        ac->ev[e] += now.v[e] - as->v[e];
+}
+
+/* Fold this OS thread's totals into the global ones */
+void ActivityThreadFlush(void)
+{
+    int a, e;
+
+    for (a = 0; a < ACT_NR; a++)
     {
-        printf("No I/O filename specified\n");
-        return false;
+        if (myActCounts[a].count == 0)
+            continue;
+        actCount[a] += myActCounts[a].count;
+        actBytes[a] += myActCounts[a].bytes;
+        actNs[a] += myActCounts[a].ns;
+        for (e = 0; e < PERF_EV_NR; e++)
+            actEvents[a][e] += myActCounts[a].ev[e];
+        memset(&myActCounts[a], 0, sizeof(myActCounts[a]));
     }
-    /* Max I/O Size must fit inside Max Memory */
-    if ((maxMem != 0) && (maxIOSize > maxMem))
+}
+
+void PerfThreadClose(void)
+{
+    int i;
+
+    if (myPerf.tried)
     {
-        printf("Maximum I/O size (%llu) must be no more than Maximum memory (%llu)\n", 
-               maxIOSize, maxMem);
-        return false;
+        for (i = 0; i < myPerf.nr; i++)
+            close(myPerf.fd[i]);
+        myPerf.nr = 0;
+        myPerf.leader = -1;
     }
-    /* Max I/O size has to be less than 2GB */
-    if (maxIOSize > (unsigned long long)0x7FFFFFFF)
+    myPerf.tried = false;
+}
+
+void ShowActivityBandwidth(void)
+{
+    int a;
+    char mChar;
+    double dVal, secs;
+
+    puts("Activity bandwidth (over time spent in each activity):");
+    for (a = 0; a < ACT_NR; a++)
     {
-        printf("Maximum I/O size (%llu) must be less than 2GB\n", 
-               maxIOSize);
-        return false;
+        if (actBytes[a].load(std::memory_order_relaxed) == 0)
+            continue;
+        secs = actNs[a].load(std::memory_order_relaxed) / 1e9;
+        printf("  %9s: %12llu times in %10.3f s, ", actNames[a],
+               actCount[a].load(std::memory_order_relaxed), secs);
+        dVal = actBytes[a].load(std::memory_order_relaxed);
+        if (secs > 0.0)
+            dVal /= secs;
+        mChar = 0;
+        if (doubleToScale(&dVal, &mChar))
+            printf("%g %ciB/s\n", dVal, mChar);
+        else
+            printf("%g B/s\n", dVal);
     }
-    
-    return true;
+    putchar('\n');
 }
 
-bool ParseArgs(int argc, char *argv[])
+void ShowActivityCounters(void)
 {
-    int c;
-    int option_index = 0;
+    int a;
+    double cyc, ins, llc, bytes;
+
+    puts("Activity counters:");
+    printf("  %-9s %12s %14s %14s %6s %12s %10s %12s\n",
+           "activity", "count", "cycles", "instructions", "IPC",
+           "LLC misses", "ctx sw", "misses/KiB");
+    for (a = 0; a < ACT_NR; a++)
+    {
+        if (actCount[a].load(std::memory_order_relaxed) == 0)
+            continue;
+        cyc = actEvents[a][PERF_EV_CYCLES].load(std::memory_order_relaxed);
+        ins = actEvents[a][PERF_EV_INSTR].load(std::memory_order_relaxed);
+        llc = actEvents[a][PERF_EV_LLCMISS].load(std::memory_order_relaxed);
+        bytes = actBytes[a].load(std::memory_order_relaxed);
+        printf("  %-9s %12llu %14.0f %14.0f %6.2f %12.0f %10llu ",
+               actNames[a], actCount[a].load(std::memory_order_relaxed),
+               cyc, ins, (cyc > 0.0) ? ins / cyc : 0.0, llc,
+               actEvents[a][PERF_EV_CSW].load(std::memory_order_relaxed));
+        if (bytes > 0.0)
+            printf("%12.3f\n", llc * 1024.0 / bytes);
+        else
+            printf("%12s\n", "-");
+    }
+    if (fiber_mode)
+        puts("  (fibers: sleeping activities include other fibers run meanwhile)");
+    putchar('\n');
+}
+
+/*
+ * Trace record/replay
+ *
+ * With --record every worker logs each activity it runs (which one, its
+ * size, file offset, extra argument and start time relative to the start
+ * of the run) into its own buffer, written out as one block per worker
+ * when it ends. With --replay the trace is mapped read-only and each
+ * worker, matched by thread number, walks its block with a private
+ * cursor. It waits for the recorded start time and uses the recorded
+ * values wherever it would have called rand(), so two replays of a trace
+ * run the same sequence. Replaying costs a pointer increment and a clock
+ * read per activity.
+ *
+ * Each block also carries when its worker started and ended. Replay
+ * starts the launch workers up front and every replacement at its
+ * recorded start time, and a worker that runs out of activities stays
+ * until its recorded end, so the same set of workers exists at the same
+ * times in every replay.
+ */
+#define TRACE_MAGIC "DWHTRC02"
+
+struct trace_hdr {
+        char     magic[8];
+        uint32_t rec_size;
+        uint32_t pad;
+    };
+
+struct trace_block {      /* Followed by count trace_rec */
+        uint32_t thread_num;
+        uint32_t count;
+        uint64_t start_ns;        /* Worker start and end, relative to the start of the run */
+        uint64_t end_ns;
+        uint32_t flags;
+        uint32_t pad;
+    };
+
+#define TRACE_BLK_INITIAL 1       /* Started at launch rather than as a replacement */
+
+struct trace_rec {
+        uint64_t at_ns;           /* Start, relative to the start of the run */
+        uint64_t size;            /* Allocation or I/O length */
+        int64_t  offset;          /* I/O file offset, -1 if none */
+        uint32_t dur_us;
+        uint8_t  activity;
+        uint8_t  arg;             /* I/O type, wait/sleep length or thread end */
+        uint16_t pad;
+    };
+
+struct trace_cursor {
+        const struct trace_rec *next;         /* Replay */
+        const struct trace_rec *end;
+        const struct trace_rec *first;
+        unsigned long long late;
+        unsigned long long start_ns;
+        unsigned long long end_ns;            /* Replay: stay until then */
+        std::vector<struct trace_rec> *log;   /* Record */
+    };
+
+std::string traceRecordName;
+std::string traceReplayName;
+FILE *traceFile = NULL;
+pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+struct timespec traceEpoch;
+void *traceMap = NULL;
+size_t traceMapLen = 0;
+std::vector<const struct trace_block *> traceBlocks;
+std::vector<const struct trace_block *> traceStarts;    /* Replacements by start time */
+size_t traceNextStart = 0;
+std::atomic<unsigned long long> nTraceRecords(0);
+std::atomic<unsigned long long> nTraceLate(0);
+
+bool TraceReplaying(void)
+{
+    return traceMap != NULL;
+}
+
+unsigned long long TraceNowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - traceEpoch.tv_sec) * 1000000000ULL) + now.tv_nsec - traceEpoch.tv_nsec;
+}
+
+bool TraceStartBefore(const struct trace_block *a, const struct trace_block *b)
+{
+    return a->start_ns < b->start_ns;
+}
+
+/* Index the blocks of a mapped trace by thread number */
+bool TraceIndex(void)
+{
+    const struct trace_hdr *hdr = (const struct trace_hdr *)traceMap;
+    const struct trace_block *blk;
+    size_t pos;
+
+    if ((traceMapLen < sizeof(*hdr)) || (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0)
+        || (hdr->rec_size != sizeof(struct trace_rec)))
+    {
+        printf("%s is not a dwh trace\n", traceReplayName.c_str());
+        return false;
+    }
+
+    for (pos = sizeof(*hdr); pos + sizeof(*blk) <= traceMapLen;
+         pos += sizeof(*blk) + blk->count * sizeof(struct trace_rec))
+    {
+        blk = (const struct trace_block *)((const char *)traceMap + pos);
+        if (pos + sizeof(*blk) + blk->count * sizeof(struct trace_rec) > traceMapLen)
+        {
+            printf("Trace %s is truncated\n", traceReplayName.c_str());
+            return false;
+        }
+        if (blk->thread_num >= traceBlocks.size())
+            traceBlocks.resize(blk->thread_num + 1, NULL);
+        traceBlocks[blk->thread_num] = blk;
+        if (!(blk->flags & TRACE_BLK_INITIAL))
+            traceStarts.push_back(blk);
+    }
+    std::stable_sort(traceStarts.begin(), traceStarts.end(), TraceStartBefore);
+    traceNextStart = 0;
+
+    return true;
+}
+
+/* Called just before the workers start, which is time zero of the trace */
+bool TraceSetup(void)
+{
+    struct trace_hdr hdr;
+    struct stat st;
+    int fd;
+
+    if (traceRecordName.length() > 0)
+    {
+        traceFile = fopen(traceRecordName.c_str(), "wb");
+        if (traceFile == NULL)
+        {
+            printf("Failed to create trace %s (%d)\n", traceRecordName.c_str(), errno);
+            return false;
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+        hdr.rec_size = sizeof(struct trace_rec);
+        if (fwrite(&hdr, sizeof(hdr), 1, traceFile) != 1)
+        {
+            printf("Failed to write trace %s\n", traceRecordName.c_str());
+            return false;
+        }
+    }
+    else if (traceReplayName.length() > 0)
+    {
+        fd = open(traceReplayName.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            printf("Failed to open trace %s (%d)\n", traceReplayName.c_str(), errno);
+            return false;
+        }
+        if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+        {
+            close(fd);
+            printf("Failed to size trace %s\n", traceReplayName.c_str());
+            return false;
+        }
+        traceMapLen = st.st_size;
+        traceMap = mmap(NULL, traceMapLen, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (traceMap == MAP_FAILED)
+        {
+            traceMap = NULL;
+            printf("Failed to map trace %s (%d)\n", traceReplayName.c_str(), errno);
+            return false;
+        }
+        if (!TraceIndex())
+            return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &traceEpoch);
+
+    return true;
+}
+
+void TraceCleanup(void)
+{
+    if (traceFile != NULL)
+    {
+        if (fclose(traceFile) != 0)
+            printf("Failed to close trace %s\n", traceRecordName.c_str());
+        traceFile = NULL;
+    }
+    if (traceMap != NULL)
+    {
+        munmap(traceMap, traceMapLen);
+        traceMap = NULL;
+    }
+}
+
+void TraceThreadStart(struct trace_cursor *c, int thread_num)
+{
+    const struct trace_block *blk;
+
+    c->next = NULL;
+    c->end = NULL;
+    c->first = NULL;
+    c->late = 0;
+    c->start_ns = TraceNowNs();
+    c->end_ns = 0;
+    c->log = NULL;
+    if (TraceReplaying())
+    {
+        if ((thread_num >= 0) && ((size_t)thread_num < traceBlocks.size())
+            && ((blk = traceBlocks[thread_num]) != NULL))
+        {
+            c->next = (const struct trace_rec *)(blk + 1);
+            c->end = c->next + blk->count;
+            c->first = c->next;
+            c->end_ns = blk->end_ns;
+        }
+    }
+    else if (traceFile != NULL)
+    {
+        c->log = new (std::nothrow) std::vector<struct trace_rec>;
+        if (c->log != NULL)
+            c->log->reserve(256);
+    }
+}
+
+/* The next recorded activity, NULL when this worker's trace is done */
+const struct trace_rec *TraceNext(struct trace_cursor *c)
+{
+    if (c->next == c->end)
+        return NULL;
+
+    return c->next++;
+}
+
+/* How long until a recorded activity is due, capped at a second */
+unsigned long long TraceDelayNs(struct trace_cursor *c, const struct trace_rec *r, bool first)
+{
+    unsigned long long ns;
+
+    ns = TraceNowNs();
+    if (ns >= r->at_ns)
+    {
+        /* More than a millisecond behind the recording */
+        if (first && (ns - r->at_ns > 1000000ULL))
+            c->late++;
+        return 0;
+    }
+    ns = r->at_ns - ns;
+
+    return (ns > 1000000000ULL) ? 1000000000ULL : ns;
+}
+
+void TraceAppend(struct trace_cursor *c, const struct timespec *start, int act,
+                 unsigned long long size, long long offset, int arg)
+{
+    struct timespec now;
+    struct trace_rec r;
+
+    if (c->log == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    r.at_ns = ((start->tv_sec - traceEpoch.tv_sec) * 1000000000ULL) + start->tv_nsec - traceEpoch.tv_nsec;
+    r.size = size;
+    r.offset = offset;
+    r.dur_us = (((now.tv_sec - start->tv_sec) * 1000000000ULL) + now.tv_nsec - start->tv_nsec) / 1000;
+    r.activity = act;
+    r.arg = arg;
+    r.pad = 0;
+    c->log->push_back(r);
+}
+
+/* How long a replayed worker with no activities left has to stay, capped at a second */
+unsigned long long TraceEndDelayNs(struct trace_cursor *c)
+{
+    unsigned long long ns = TraceNowNs();
+
+    if (ns >= c->end_ns)
+        return 0;
+    ns = c->end_ns - ns;
+
+    return (ns > 1000000000ULL) ? 1000000000ULL : ns;
+}
+
+/* Write a worker's recording out as one block, or count what it replayed */
+void TraceThreadEnd(struct trace_cursor *c, int thread_num, bool initial)
+{
+    struct trace_block blk;
+
+    if (c->first != NULL)
+    {
+        nTraceRecords += c->next - c->first;
+        nTraceLate += c->late;
+        c->first = NULL;
+    }
+    if (c->log == NULL)
+        return;
+    blk.thread_num = thread_num;
+    blk.count = c->log->size();
+    blk.start_ns = c->start_ns;
+    blk.end_ns = TraceNowNs();
+    blk.flags = initial ? TRACE_BLK_INITIAL : 0;
+    blk.pad = 0;
+    pthread_mutex_lock(&tracelock);
+    if ((fwrite(&blk, sizeof(blk), 1, traceFile) != 1)
+        || (fwrite(c->log->data(), sizeof(struct trace_rec), blk.count, traceFile) != blk.count))
+        printf("Failed to write trace of thread %d\n", thread_num);
+    pthread_mutex_unlock(&tracelock);
+    nTraceRecords += blk.count;
+    delete c->log;
+    c->log = NULL;
+}
+
+bool VerifySettings()
+{
+    /* We must have threads */
+    if (minthreads == 0)
+    {
+        printf("Not enough threads (%d), use --minthreads <num>\n", minthreads);
+        return false;
+    }
+    /* Max threads can't be lower than min threads */
+    if (minthreads > maxthreads)
+    {
+        printf("Max threads (%d) must be greater than or equal to Min threads (%d), use --maxthreads <num>\n", 
+               maxthreads, minthreads);
+        return false;
+    }
+    /* I/O threads come from all threads and must leave some */
+    if (iothreads >= minthreads)
+    {
+        printf("I/O threads (%d) must be less than Min Threads (%d), use --iothreads <num>\n", 
+               iothreads, minthreads);
+        return false;
+    }
+    /* Time must be greater than zero */
+    if (maxruntime < 1)
+    {
+        printf("Runtime (--time <num>) must be greater than zero (%u)\n", 
+               maxruntime);
+        return false;
+    }
+    /* There must be an I/O filename target */
+    if (ioFilename.length() < 1)
+    {
+        printf("No I/O filename specified\n");
+        return false;
+    }
+    /* Max I/O Size must fit inside Max Memory */
+    if ((maxMem != 0) && (maxIOSize > maxMem))
+    {
+        printf("Maximum I/O size (%llu) must be no more than Maximum memory (%llu)\n", 
+               maxIOSize, maxMem);
+        return false;
+    }
+    /* Fibers need enough stack for the worker loop and printf */
+    if (fiber_mode && (fiberStackSize < 16 * 1024))
+    {
+        printf("Fiber stack size (%llu) must be at least 16k\n", fiberStackSize);
+        return false;
+    }
+    /* A run either records a trace or replays one */
+    if ((traceRecordName.length() > 0) && (traceReplayName.length() > 0))
+    {
+        printf("Use only one of --record and --replay\n");
+        return false;
+    }
+    /* Max I/O size has to be less than 2GB */
+    if (maxIOSize > (unsigned long long)0x7FFFFFFF)
+    {
+        printf("Maximum I/O size (%llu) must be less than 2GB\n", 
+               maxIOSize);
+        return false;
+    }
+    
+    return true;
+}
+
+bool ParseArgs(int argc, char *argv[])
+{
+    int c;
+    int option_index = 0;
 
     while (1) {
         c = getopt_long(argc, argv, "i:x:n:m:h", long_options, &option_index);
@@ -516,6 +1510,51 @@ bool ParseArgs(int argc, char *argv[])
                 maxIOSize = memsztoull(optarg);
                 break;
 
+            case 'T':
+                if (verbose_flag)
+                    printf ("option --schedthreads with value `%s'\n", optarg);
+                schedthreads = strtoui(optarg);
+                break;
+
+            case 'A':
+                if (verbose_flag)
+                    printf ("option --alloc with value `%s'\n", optarg);
+                for (allocBackend = ALLOC_HUGETLB; allocBackend > ALLOC_CALLOC; allocBackend--)
+                {
+                    if (strcmp(optarg, allocNames[allocBackend]) == 0)
+                        break;
+                }
+                if (strcmp(optarg, allocNames[allocBackend]) != 0)
+                {
+                    printf("Unknown --alloc type %s, use calloc, thp or hugetlb\n", optarg);
+                    return false;
+                }
+                break;
+
+            case 'P':
+                if (verbose_flag)
+                    printf ("option --hugepool with value `%s'\n", optarg);
+                hugePoolSize = memsztoull(optarg);
+                break;
+
+            case 'K':
+                if (verbose_flag)
+                    printf ("option --fiberstack with value `%s'\n", optarg);
+                fiberStackSize = memsztoull(optarg);
+                break;
+
+            case 'R':
+                if (verbose_flag)
+                    printf ("option --record with value `%s'\n", optarg);
+                traceRecordName = optarg;
+                break;
+
+            case 'Y':
+                if (verbose_flag)
+                    printf ("option --replay with value `%s'\n", optarg);
+                traceReplayName = optarg;
+                break;
+
             default:
                 return false;
         }
@@ -540,6 +1579,10 @@ bool ParseArgs(int argc, char *argv[])
             puts ("Worker threads are started at launch and left running");
     }
 
+    /* The self test needs none of the run settings */
+    if (fiber_test)
+        return true;
+
     /* Any remaining arguments */
     if (optind < argc)
     {
@@ -557,6 +1600,15 @@ bool ParseArgs(int argc, char *argv[])
     printf(" Max Threads: %u\n", maxthreads);
     printf(" Min Threads: %u\n", minthreads);
     printf(" I/O Threads: %u\n", iothreads);
+    if (fiber_mode)
+    {
+        if (schedthreads == 0)
+            schedthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (schedthreads == 0)
+            schedthreads = 1;
+        printf("      Fibers: workers over %u scheduler threads, %llu byte stacks\n",
+               schedthreads, fiberStackSize);
+    }
     putchar ('\n');
     printf("     Run for: %u s\n", maxruntime);
     putchar('\n');
@@ -565,7 +1617,12 @@ bool ParseArgs(int argc, char *argv[])
         puts(" (No limit)");
     putchar('\n');
     printf("Max I/O size: %llu\n", maxIOSize);
+    printf("Buffer alloc: %s\n", allocNames[allocBackend]);
     printf("I/O file: %s\n", ioFilename.c_str());
+    if (traceRecordName.length() > 0)
+        printf("Record trace: %s\n", traceRecordName.c_str());
+    if (traceReplayName.length() > 0)
+        printf("Replay trace: %s\n", traceReplayName.c_str());
     putchar('\n');
 
     /* Get Started */
@@ -610,172 +1667,827 @@ bool setupSyncObjects(void)
     }
     initObjects |= INIT_IORSKLOCK;
 
-    if (pthread_mutex_init(&iowsklock, NULL) != 0)
+    if (pthread_mutex_init(&iowsklock, NULL) != 0)
+    {
+        printf("I/O seek/write mutex setup failed\n");
+        return false;
+    }
+    initObjects |= INIT_IOWSKLOCK;
+
+    return true;
+}
+
+bool destroySyncObjects(void)
+{
+    if (initObjects & INIT_IOWSKLOCK)
+    {
+        if (pthread_mutex_destroy(&iowsklock) != 0)
+        {
+            printf("I/O seek/write mutex destroy failed\n");
+            return false;
+        }
+        initObjects ^= INIT_IOWSKLOCK;
+    }
+
+    if (initObjects & INIT_IORSKLOCK)
+    {
+        if (pthread_mutex_destroy(&iorsklock) != 0)
+        {
+            printf("I/O seek/read mutex destroy failed\n");
+            return false;
+        }
+        initObjects ^= INIT_IORSKLOCK;
+    }
+
+    if (initObjects & INIT_IODNLOCK)
+    {
+        if (pthread_mutex_destroy(&iodnlock) != 0)
+        {
+            printf("I/O done mutex destroy failed\n");
+            return false;
+        }
+        initObjects ^= INIT_IODNLOCK;
+    }
+
+    if (initObjects & INIT_IOWRLOCK)
+    {
+        if (pthread_mutex_destroy(&iowrlock) != 0)
+        {
+            printf("I/O write mutex destroy failed\n");
+            return false;
+        }
+        initObjects ^= INIT_IOWRLOCK;
+    }
+
+    if (initObjects & INIT_IORDLOCK)
+    {
+        if (pthread_mutex_destroy(&iordlock) != 0)
+        {
+            printf("I/O read mutex destroy failed\n");
+            return false;
+        }
+        initObjects ^= INIT_IORDLOCK;
+    }
+
+    if (initObjects & INIT_WKTILOCK)
+    {
+        if (pthread_mutex_destroy(&wktilock) != 0)
+        {
+            printf("wktinfo mutex destroy failed\n");
+            return false;
+        }
+        initObjects ^= INIT_WKTILOCK;
+    }
+
+    return true;
+}
+
+bool setupDataFile(void)
+{
+    size_t s;
+    unsigned long long writeSize;
+    unsigned long long curSize;
+    unsigned char *fillData = NULL;
+
+    if ((ioReadStream == NULL) && (ioWriteStream == NULL))
+    {
+        printf("Pre-populating I/O file %s\n (This may take a short time)\n", ioFilename.c_str());
+        if (ioFilename.length() == 0)
+            return false;
+
+        ioWriteStream = fopen(ioFilename.c_str(), "w+");
+        if (ioWriteStream == NULL)
+            return false;
+
+        ioReadStream = fopen(ioFilename.c_str(), "r");
+        if (ioReadStream == NULL)
+            return false;
+
+        /* Initialize the file to twice the memory limit or 6G if no limit */
+        fileSize = maxMem;
+        if (fileSize == 0)
+        {
+            fileSize = 1024 * 1024;
+            fileSize *= 1024;
+            fileSize *= 6;
+        }
+        else
+        {
+            fileSize *= 2;
+        }
+        writeSize = 1024 * 1024;
+        writeSize *= 1024;
+        if (writeSize > fileSize)
+            writeSize = fileSize;
+        fillData = (unsigned char *)calloc(1, writeSize);
+        if (fillData == NULL)
+        {
+            fileSize = 0;
+            return false;
+        }
+
+        curSize = 0;
+        while (curSize <= fileSize)
+        {
+            s = fwrite(fillData, writeSize, 1, ioWriteStream);
+            if (s < 1)
+            {
+                fileSize = 0;
+                free(fillData);
+                fillData = NULL;
+                return false;
+            }
+
+            curSize += writeSize;
+        }
+    }
+    if (fillData != NULL)
+    {
+        free(fillData);
+        fillData = NULL;
+    }
+
+    return true;
+}
+
+bool cleanupDataFile(void)
+{
+    bool result = true;
+
+    while (nThreads > 0)
+    {
+        sleep(1);
+    }
+    if (ioReadStream != NULL)
+    {
+        if (fclose(ioReadStream) != 0)
+            if (result)
+                result = false;
+    }
+    if (ioWriteStream != NULL)
+    {
+        if (fclose(ioWriteStream) != 0)
+            if (result)
+                result = false;
+        if (remove(ioFilename.c_str()) != 0)
+            if (result)
+                result = false;
+    }
+
+    return result;
+}
+
+/*
+ * Fiber engine (--fibers)
+ *
+ * Workers run as ucontext fibers on a fixed set of scheduler pthreads.
+ * A fiber only leaves its scheduler when it yields, sleeps or waits for
+ * I/O; the scheduler then decides what to do with it from fiber->state.
+ * Parking is a two step handshake so a wake arriving while the fiber is
+ * still switching out is not lost: the fiber marks itself PARKING, the
+ * scheduler moves PARKING to PARKED after the switch, and a waker that
+ * finds PARKING marks it WOKEN so the scheduler requeues it instead.
+ */
+#define FIBER_RUNNABLE 0
+#define FIBER_RUNNING  1
+#define FIBER_PARKING  2
+#define FIBER_PARKED   3
+#define FIBER_WOKEN    4
+#define FIBER_DONE     5
+
+struct fiber {
+        ucontext_t ctx;
+        std::atomic<int> state;
+        unsigned int home;        /* Scheduler it last ran on */
+        unsigned int parkSeq;     /* Bumped on each park, stale timers are ignored */
+        std::atomic<int> refs;    /* One for the fiber, one per queued timer */
+        void *(*entry)(void *);
+        void *arg;
+        void *stack;              /* mmap'd, lowest page is a guard page */
+        size_t stackSize;
+    };
+
+struct fiber_timer {
+        struct timespec due;
+        struct fiber *f;
+        unsigned int seq;
+    };
+
+bool tsBefore(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec;
+    return a->tv_nsec < b->tv_nsec;
+}
+
+struct fiber_timer_later {
+        bool operator()(const fiber_timer &a, const fiber_timer &b) const
+        {
+            return tsBefore(&b.due, &a.due);
+        }
+    };
+
+struct fiber_sched {
+        pthread_t thread_id;
+        unsigned int num;
+        ucontext_t ctx;           /* Scheduler loop context */
+        struct fiber *current;
+        pthread_mutex_t rqlock;   /* Protects runq, taken by wakers and thieves */
+        pthread_cond_t rqcond;
+        bool idle;
+        std::deque<struct fiber *> runq;
+        /* Only touched by this scheduler's own thread */
+        std::priority_queue<fiber_timer, std::vector<fiber_timer>, fiber_timer_later> timers;
+    };
+
+struct fiber_sched *fiberScheds = NULL;
+std::atomic<int> nLiveFibers(0);
+std::atomic<unsigned int> nextFiberSched(0);
+std::atomic<unsigned long long> nFiberSteals(0);
+std::atomic<unsigned long long> nFiberSwitches(0);
+static thread_local struct fiber_sched *fiberCurSched = NULL;
+
+/*
+ * A fiber can resume on a different scheduler thread than it parked on,
+ * so never let the compiler cache the thread_local address across a switch.
+ */
+__attribute__((noinline)) struct fiber_sched *FiberCurrentSched(void)
+{
+    struct fiber_sched *s = fiberCurSched;
+
+    __asm__ __volatile__("" : "+r"(s));
+    return s;
+}
+
+bool InFiber(void)
+{
+    struct fiber_sched *s = FiberCurrentSched();
+
+    return (s != NULL) && (s->current != NULL);
+}
+
+void tsAddNs(struct timespec *ts, unsigned long long ns)
+{
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec += ns % 1000000000ULL;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+void FiberPush(struct fiber_sched *s, struct fiber *f)
+{
+    pthread_mutex_lock(&s->rqlock);
+    s->runq.push_back(f);
+    if (s->idle)
+        pthread_cond_signal(&s->rqcond);
+    pthread_mutex_unlock(&s->rqlock);
+}
+
+/* Make a parked fiber runnable again, safe to call from any thread */
+void FiberWake(struct fiber *f)
+{
+    int st;
+
+    if (f == NULL)
+        return;
+
+    st = f->state.load();
+    while (true)
+    {
+        if (st == FIBER_PARKED)
+        {
+            if (f->state.compare_exchange_weak(st, FIBER_RUNNABLE))
+            {
+                FiberPush(&fiberScheds[f->home], f);
+                return;
+            }
+        }
+        else if (st == FIBER_PARKING)
+        {
+            if (f->state.compare_exchange_weak(st, FIBER_WOKEN))
+                return;
+        }
+        else
+        {
+            /* Running, runnable or already woken, it will see the event itself */
+            return;
+        }
+    }
+}
+
+/*
+ * A fiber can finish while timers for earlier parks are still queued,
+ * possibly on another scheduler, or while an I/O thread is about to wake
+ * it.  Those hold a reference so the struct stays around until the last
+ * of them lets go; the stack is unmapped as soon as the fiber is done.
+ */
+struct fiber *FiberGet(struct fiber *f)
+{
+    if (f != NULL)
+        f->refs++;
+    return f;
+}
+
+void FiberPut(struct fiber *f)
+{
+    if ((f != NULL) && (--f->refs == 0))
+        CountingFree(f);
+}
+
+/* Switch from the running fiber back to its scheduler */
+void FiberSwitchOut(int newState)
+{
+    struct fiber_sched *s = FiberCurrentSched();
+    struct fiber *f = s->current;
+
+    f->state.store(newState);
+    swapcontext(&f->ctx, &s->ctx);
+}
+
+void FiberYield(void)
+{
+    FiberSwitchOut(FIBER_RUNNABLE);
+}
+
+/* Park the running fiber until FiberWake() or until ns have passed */
+void FiberParkFor(unsigned long long ns)
+{
+    struct fiber_sched *s = FiberCurrentSched();
+    struct fiber *f = s->current;
+    fiber_timer t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t.due);
+    tsAddNs(&t.due, ns);
+    t.f = f;
+    t.seq = ++f->parkSeq;
+    f->refs++;
+    s->timers.push(t);
+
+    FiberSwitchOut(FIBER_PARKING);
+}
+
+/* Wait for a semaphore post or a timeout without consuming the post */
+void FiberWaitSem(sem_t *sem, unsigned long long ns)
+{
+    struct fiber_sched *s = FiberCurrentSched();
+    struct fiber *f = s->current;
+    fiber_timer t;
+    int v;
+
+    f->state.store(FIBER_PARKING);
+    /* Re-check after announcing the park, a post before this is not lost */
+    if ((sem_getvalue(sem, &v) == 0) && (v > 0))
+    {
+        f->state.store(FIBER_RUNNING);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t.due);
+    tsAddNs(&t.due, ns);
+    t.f = f;
+    t.seq = ++f->parkSeq;
+    f->refs++;
+    s->timers.push(t);
+
+    swapcontext(&f->ctx, &s->ctx);
+}
+
+/* Sleep that parks the fiber in fiber mode and blocks the thread otherwise */
+void WorkerSleep(unsigned int sec, long nsec)
+{
+    struct timespec ts;
+
+    if (InFiber())
+    {
+        FiberParkFor(((unsigned long long)sec * 1000000000ULL) + nsec);
+        return;
+    }
+    ts.tv_sec = sec;
+    ts.tv_nsec = nsec;
+    nanosleep(&ts, NULL);
+}
+
+/* Wait for an I/O completion post, or sleep(1) when not a fiber */
+void WorkerWaitIO(sem_t *sem)
+{
+    if (InFiber())
+        FiberWaitSem(sem, 1000000000ULL);
+    else
+        sleep(1);
+}
+
+/* sigtimedwait that never blocks a fiber's scheduler thread */
+int WorkerSigTimedWait(const sigset_t *set, siginfo_t *info, const struct timespec *timeout)
+{
+    struct timespec zero;
+    int s;
+
+    if (!InFiber())
+        return sigtimedwait(set, info, timeout);
+
+    zero.tv_sec = 0;
+    zero.tv_nsec = 0;
+    s = sigtimedwait(set, info, &zero);
+    if (s < 0)
+        FiberParkFor(((unsigned long long)timeout->tv_sec * 1000000000ULL) + timeout->tv_nsec);
+
+    return s;
+}
+
+void FiberTrampoline(void)
+{
+    struct fiber_sched *s = FiberCurrentSched();
+    struct fiber *f = s->current;
+
+    f->entry(f->arg);
+
+    /* Probably a different scheduler by now */
+    s = FiberCurrentSched();
+    f->state.store(FIBER_DONE);
+    setcontext(&s->ctx);
+}
+
+int FiberSpawn(void *(*entry)(void *), void *arg)
+{
+    struct fiber *f;
+    unsigned int home;
+    size_t pg = sysconf(_SC_PAGESIZE);
+
+    f = (struct fiber *)CountingCalloc(1, sizeof(*f));
+    if (f == NULL)
+        return -1;
+
+    f->stackSize = ((fiberStackSize + pg - 1) / pg) * pg + pg;
+    f->stack = mmap(NULL, f->stackSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (f->stack == MAP_FAILED)
+    {
+        CountingFree(f);
+        return -1;
+    }
+    (void)mprotect(f->stack, pg, PROT_NONE);
+
+    if (getcontext(&f->ctx) != 0)
+    {
+        munmap(f->stack, f->stackSize);
+        CountingFree(f);
+        return -1;
+    }
+    f->ctx.uc_stack.ss_sp = (char *)f->stack + pg;
+    f->ctx.uc_stack.ss_size = f->stackSize - pg;
+    f->ctx.uc_link = NULL;
+    makecontext(&f->ctx, FiberTrampoline, 0);
+
+    f->entry = entry;
+    f->arg = arg;
+    home = nextFiberSched++ % schedthreads;
+    f->home = home;
+    f->state.store(FIBER_RUNNABLE);
+    f->refs.store(1);
+    nLiveFibers++;
+    FiberPush(&fiberScheds[home], f);
+
+    return 0;
+}
+
+/* Move fibers whose sleep or I/O wait timed out back onto our run queue */
+void FiberRunTimers(struct fiber_sched *me)
+{
+    struct timespec now;
+    fiber_timer t;
+
+    if (me->timers.empty())
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (!me->timers.empty())
+    {
+        t = me->timers.top();
+        if (tsBefore(&now, &t.due))
+            break;
+        me->timers.pop();
+        if (t.seq == t.f->parkSeq)
+            FiberWake(t.f);
+        FiberPut(t.f);
+    }
+}
+
+struct fiber *FiberPop(struct fiber_sched *me)
+{
+    struct fiber *f = NULL;
+
+    pthread_mutex_lock(&me->rqlock);
+    if (!me->runq.empty())
     {
-        printf("I/O seek/write mutex setup failed\n");
-        return false;
+        f = me->runq.front();
+        me->runq.pop_front();
     }
-    initObjects |= INIT_IOWSKLOCK;
+    pthread_mutex_unlock(&me->rqlock);
 
-    return true;
+    return f;
 }
 
-bool destroySyncObjects(void)
+/* Take a runnable fiber from the tail of another scheduler's queue */
+struct fiber *FiberSteal(struct fiber_sched *me)
 {
-    if (initObjects & INIT_IOWSKLOCK)
+    struct fiber_sched *victim;
+    struct fiber *f = NULL;
+    unsigned int i;
+
+    for (i = 1; (i < schedthreads) && (f == NULL); i++)
     {
-        if (pthread_mutex_destroy(&iowsklock) != 0)
+        victim = &fiberScheds[(me->num + i) % schedthreads];
+        if (pthread_mutex_trylock(&victim->rqlock) != 0)
+            continue;
+        if (victim->runq.size() > 1)
         {
-            printf("I/O seek/write mutex destroy failed\n");
-            return false;
+            f = victim->runq.back();
+            victim->runq.pop_back();
         }
-        initObjects ^= INIT_IOWSKLOCK;
+        pthread_mutex_unlock(&victim->rqlock);
     }
+    if (f != NULL)
+        nFiberSteals++;
 
-    if (initObjects & INIT_IORSKLOCK)
+    return f;
+}
+
+/* Nothing to run, wait for a push or our next timer (at most 1ms so we keep stealing) */
+void FiberIdle(struct fiber_sched *me)
+{
+    struct timespec deadline, limit;
+
+    clock_gettime(CLOCK_MONOTONIC, &limit);
+    tsAddNs(&limit, 1000000ULL);
+    deadline = limit;
+    if (!me->timers.empty() && tsBefore(&me->timers.top().due, &limit))
+        deadline = me->timers.top().due;
+
+    pthread_mutex_lock(&me->rqlock);
+    if (me->runq.empty())
     {
-        if (pthread_mutex_destroy(&iorsklock) != 0)
-        {
-            printf("I/O seek/read mutex destroy failed\n");
-            return false;
-        }
-        initObjects ^= INIT_IORSKLOCK;
+        me->idle = true;
+        (void)pthread_cond_timedwait(&me->rqcond, &me->rqlock, &deadline);
+        me->idle = false;
     }
+    pthread_mutex_unlock(&me->rqlock);
+}
 
-    if (initObjects & INIT_IODNLOCK)
+void FiberRun(struct fiber_sched *me, struct fiber *f)
+{
+    int st;
+
+    me->current = f;
+    f->home = me->num;
+    f->state.store(FIBER_RUNNING);
+    swapcontext(&me->ctx, &f->ctx);
+    me->current = NULL;
+    nFiberSwitches++;
+
+    st = f->state.load();
+    switch (st)
     {
-        if (pthread_mutex_destroy(&iodnlock) != 0)
-        {
-            printf("I/O done mutex destroy failed\n");
-            return false;
-        }
-        initObjects ^= INIT_IODNLOCK;
+        case FIBER_DONE:
+            munmap(f->stack, f->stackSize);
+            nLiveFibers--;
+            FiberPut(f);
+            break;
+
+        case FIBER_PARKING:
+            if (f->state.compare_exchange_strong(st, FIBER_PARKED))
+                break;
+            /* Woken while switching out */
+            /* FALLTHROUGH */
+
+        case FIBER_WOKEN:
+            f->state.store(FIBER_RUNNABLE);
+            FiberPush(me, f);
+            break;
+
+        case FIBER_RUNNABLE:
+            FiberPush(me, f);
+            break;
+
+        default:
+            break;
     }
+}
 
-    if (initObjects & INIT_IOWRLOCK)
+void *FiberSchedStart(void *arg)
+{
+    struct fiber_sched *me = (struct fiber_sched *)arg;
+    struct fiber *f;
+
+    fiberCurSched = me;
+    if (Diagnose)
+        printf("Fiber scheduler %u started\n", me->num);
+
+    while (!EndAllThreads || (nLiveFibers.load(std::memory_order_relaxed) > 0))
     {
-        if (pthread_mutex_destroy(&iowrlock) != 0)
+        FiberRunTimers(me);
+        f = FiberPop(me);
+        if (f == NULL)
+            f = FiberSteal(me);
+        if (f == NULL)
         {
-            printf("I/O write mutex destroy failed\n");
-            return false;
+            FiberIdle(me);
+            continue;
         }
-        initObjects ^= INIT_IOWRLOCK;
+        FiberRun(me, f);
     }
 
-    if (initObjects & INIT_IORDLOCK)
+    /* Timers that outlived their fibers only hold references now */
+    while (!me->timers.empty())
     {
-        if (pthread_mutex_destroy(&iordlock) != 0)
-        {
-            printf("I/O read mutex destroy failed\n");
-            return false;
-        }
-        initObjects ^= INIT_IORDLOCK;
+        FiberPut(me->timers.top().f);
+        me->timers.pop();
     }
 
-    if (initObjects & INIT_WKTILOCK)
+    if (Diagnose)
+        printf("Fiber scheduler %u ending\n", me->num);
+    ActivityThreadFlush();
+    if (perf_flag)
+        PerfThreadClose();
+    fiberCurSched = NULL;
+
+    return NULL;
+}
+
+bool FiberEngineStart(void)
+{
+    unsigned int n;
+    pthread_condattr_t cattr;
+
+    fiberScheds = new (std::nothrow) fiber_sched[schedthreads];
+    if (fiberScheds == NULL)
+        return false;
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    for (n = 0; n < schedthreads; n++)
     {
-        if (pthread_mutex_destroy(&wktilock) != 0)
+        fiberScheds[n].num = n;
+        fiberScheds[n].current = NULL;
+        fiberScheds[n].idle = false;
+        pthread_mutex_init(&fiberScheds[n].rqlock, NULL);
+        pthread_cond_init(&fiberScheds[n].rqcond, &cattr);
+    }
+    pthread_condattr_destroy(&cattr);
+
+    for (n = 0; n < schedthreads; n++)
+    {
+        if (pthread_create(&fiberScheds[n].thread_id, NULL, FiberSchedStart, &fiberScheds[n]) != 0)
         {
-            printf("wktinfo mutex destroy failed\n");
+            printf("Failed to create fiber scheduler %u\n", n);
+            schedthreads = n;
             return false;
         }
-        initObjects ^= INIT_WKTILOCK;
     }
 
     return true;
 }
 
-bool setupDataFile(void)
+void FiberEngineStop(void)
 {
-    size_t s;
-    unsigned long long writeSize;
-    unsigned long long curSize;
-    unsigned char *fillData = NULL;
+    unsigned int n;
 
-    if ((ioReadStream == NULL) && (ioWriteStream == NULL))
-    {
-        printf("Pre-populating I/O file %s\n (This may take a short time)\n", ioFilename.c_str());
-        if (ioFilename.length() == 0)
-            return false;
+    if (fiberScheds == NULL)
+        return;
 
-        ioWriteStream = fopen(ioFilename.c_str(), "w+");
-        if (ioWriteStream == NULL)
-            return false;
+    for (n = 0; n < schedthreads; n++)
+        pthread_join(fiberScheds[n].thread_id, NULL);
+    for (n = 0; n < schedthreads; n++)
+    {
+        pthread_cond_destroy(&fiberScheds[n].rqcond);
+        pthread_mutex_destroy(&fiberScheds[n].rqlock);
+    }
+    delete[] fiberScheds;
+    fiberScheds = NULL;
+}
 
-        ioReadStream = fopen(ioFilename.c_str(), "r");
-        if (ioReadStream == NULL)
-            return false;
+/*
+ * --fibertest
+ *
+ * Waiters park on a semaphore with a long timeout and are woken early
+ * the way queueIODone() does it, so they finish while their timers are
+ * still queued.  The stale timers must then fire without touching a
+ * freed fiber, and once they have every fiber must be freed.  Worth
+ * running under ASan.
+ */
+#define FIBER_TEST_WAITERS 64
+#define FIBER_TEST_TIMEOUT 200000000ULL
+
+struct fiber_test_waiter {
+        sem_t sem;
+        std::atomic<struct fiber *> f;
+        std::atomic<bool> early;
+        std::atomic<bool> done;
+    };
 
-        /* Initialize the file to twice the memory limit or 6G if no limit */
-        fileSize = maxMem;
-        if (fileSize == 0)
-        {
-            fileSize = 1024 * 1024;
-            fileSize *= 1024;
-            fileSize *= 6;
-        }
-        else
-        {
-            fileSize *= 2;
-        }
-        writeSize = 1024 * 1024;
-        writeSize *= 1024;
-        if (writeSize > fileSize)
-            writeSize = fileSize;
-        fillData = (unsigned char *)calloc(1, writeSize);
-        if (fillData == NULL)
-        {
-            fileSize = 0;
-            return false;
-        }
+void *FiberTestWaiter(void *arg)
+{
+    struct fiber_test_waiter *w = (struct fiber_test_waiter *)arg;
+    struct timespec start, end;
+    unsigned long long ns;
 
-        curSize = 0;
-        while (curSize <= fileSize)
-        {
-            s = fwrite(fillData, writeSize, 1, ioWriteStream);
-            if (s < 1)
-            {
-                fileSize = 0;
-                free(fillData);
-                fillData = NULL;
-                return false;
-            }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* Held for the waker, like an I/O node does */
+    w->f.store(FiberGet(FiberCurrentSched()->current));
+    while (sem_trywait(&w->sem) != 0)
+        FiberWaitSem(&w->sem, FIBER_TEST_TIMEOUT);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-            curSize += writeSize;
-        }
-    }
-    if (fillData != NULL)
-    {
-        free(fillData);
-        fillData = NULL;
-    }
+    ns = ((end.tv_sec - start.tv_sec) * 1000000000ULL) + end.tv_nsec - start.tv_nsec;
+    w->early.store(ns < FIBER_TEST_TIMEOUT);
+    w->done.store(true);
 
-    return true;
+    return NULL;
 }
 
-bool cleanupDataFile(void)
+bool FiberSelfTest(void)
 {
+    struct fiber_test_waiter *w;
+    struct fiber *f;
+    unsigned long long before;
+    unsigned int n, nEarly = 0, nDone = 0;
     bool result = true;
 
-    while (nThreads > 0)
+    if (schedthreads == 0)
+        schedthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (schedthreads == 0)
+        schedthreads = 1;
+    printf("Fiber test: %u waiters over %u scheduler threads\n", FIBER_TEST_WAITERS, schedthreads);
+
+    w = new fiber_test_waiter[FIBER_TEST_WAITERS];
+    for (n = 0; n < FIBER_TEST_WAITERS; n++)
     {
-        sleep(1);
+        sem_init(&w[n].sem, 0, 0);
+        w[n].f.store(NULL);
+        w[n].early.store(false);
+        w[n].done.store(false);
     }
-    if (ioReadStream != NULL)
+
+    before = memUsed.load();
+    if (!FiberEngineStart())
     {
-        if (fclose(ioReadStream) != 0)
-            if (result)
-                result = false;
+        printf("Fiber test: failed to start schedulers\n");
+        FiberEngineStop();
+        delete[] w;
+        return false;
     }
-    if (ioWriteStream != NULL)
+    for (n = 0; n < FIBER_TEST_WAITERS; n++)
     {
-        if (fclose(ioWriteStream) != 0)
-            if (result)
-                result = false;
-        if (remove(ioFilename.c_str()) != 0)
-            if (result)
-                result = false;
+        if (FiberSpawn(FiberTestWaiter, &w[n]) != 0)
+        {
+            printf("Fiber test: failed to spawn waiter %u\n", n);
+            result = false;
+            break;
+        }
+    }
+
+    /* Let them all park, then wake them well before the timeout */
+    if (result)
+    {
+        for (n = 0; n < FIBER_TEST_WAITERS; n++)
+            while (w[n].f.load() == NULL)
+                usleep(1000);
+        usleep(20000);
+        for (n = 0; n < FIBER_TEST_WAITERS; n++)
+        {
+            f = w[n].f.load();
+            sem_post(&w[n].sem);
+            FiberWake(f);
+            FiberPut(f);
+        }
+    }
+
+    /* Every timer has fired by now, most of them for finished fibers */
+    usleep((2 * FIBER_TEST_TIMEOUT) / 1000);
+    EndAllThreads = true;
+    FiberEngineStop();
+
+    for (n = 0; n < FIBER_TEST_WAITERS; n++)
+    {
+        if (w[n].done.load())
+            nDone++;
+        if (w[n].early.load())
+            nEarly++;
+        sem_destroy(&w[n].sem);
+    }
+    delete[] w;
+
+    printf("Fiber test: %u finished, %u woken before their timeout\n", nDone, nEarly);
+    if ((nDone != FIBER_TEST_WAITERS) || (nEarly != FIBER_TEST_WAITERS))
+        result = false;
+    if (memUsed.load() != before)
+    {
+        printf("Fiber test: %llu bytes of fibers never freed\n", memUsed.load() - before);
+        result = false;
     }
+    puts(result ? "Fiber test: PASS" : "Fiber test: FAIL");
 
     return result;
 }
@@ -790,6 +2502,10 @@ void EndPThreads(void)
         sleep(1);
     } while (nThreads.load(std::memory_order_relaxed) > 0);
 
+    /* Worker fibers are gone, let the schedulers drain and exit */
+    if (fiber_mode)
+        FiberEngineStop();
+
     CountingFree(iotinfo);
     iotinfo = NULL;
     CountingFree(wktinfo);
@@ -822,7 +2538,7 @@ bool isReadQEmpty(void)
 
     if (readQLock())
     {
-        result = (io_readQHead != NULL);
+        result = (io_readQHead == NULL);
         if (!readQUnlock())
         {
             printf("Failed to exit I/O read lock critical section (isReadQEmpty), exiting\n");
@@ -969,7 +2685,7 @@ void clearIOReadQ(void)
             {
                 io_readQTail = NULL;
             }
-            free(node);
+            putPoolIONode(node);
             node = NULL;
             pendingIOReads--;
         }
@@ -1010,7 +2726,7 @@ bool isWriteQEmpty(void)
 
     if (writeQLock())
     {
-        result = (io_writeQHead != NULL);
+        result = (io_writeQHead == NULL);
         if (!writeQUnlock())
         {
             printf("Failed to exit I/O read lock critical section (isWriteQEmpty), exiting\n");
@@ -1127,7 +2843,7 @@ void clearIOWriteQ(void)
             {
                 io_writeQTail = NULL;
             }
-            free(node);
+            putPoolIONode(node);
             node = NULL;
             pendingIOWrites--;
         }
@@ -1168,7 +2884,7 @@ bool isDoneQEmpty(void)
 
     if (doneQLock())
     {
-        result = (io_doneQHead != NULL);
+        result = (io_doneQHead == NULL);
         if (!doneQUnlock())
         {
             printf("Failed to exit I/O done lock critical section (isDoneQEmpty), exiting\n");
@@ -1224,6 +2940,7 @@ bool queueIODone(io_queue_node *node)
 {
     bool result = false;
     int ts;
+    struct fiber *waiter;
 
     if (node != NULL)
     {
@@ -1255,7 +2972,11 @@ bool queueIODone(io_queue_node *node)
             {
                 if (Diagnose)
                     printf("Signaling I/O waiter\n");
+                /* The waiter may free the node as soon as it sees the post */
+                waiter = node->my_fiber;
                 ts = sem_post(node->my_sem);
+                FiberWake(waiter);
+                FiberPut(waiter);
                 if (ts != 0)
                 {
                     if (Diagnose)
@@ -1307,7 +3028,7 @@ void clearIODoneQ(void)
             {
                 io_doneQTail = NULL;
             }
-            free(node);
+            putPoolIONode(node);
             node = NULL;
             pendingIODone--;
         }
@@ -1378,7 +3099,11 @@ bool ioFileRead(io_queue_node *node)
         return false;
 
     pos = fileSize - node->io_len - 1;
-    pos = (rand() * pos) / RAND_MAX;
+    if ((node->io_pos >= 0) && ((size_t)node->io_pos <= pos))
+        pos = node->io_pos;
+    else
+        pos = (rand() * pos) / RAND_MAX;
+    node->io_pos = pos;
     newPos = lseek64(node->my_fd, pos, SEEK_SET);
     if (newPos != (off_t)-1)
     {
@@ -1453,7 +3178,11 @@ bool ioFileWrite(io_queue_node *node)
         return false;
 
     pos = fileSize - node->io_len - 1;
-    pos = (rand() * pos) / RAND_MAX;
+    if ((node->io_pos >= 0) && ((size_t)node->io_pos <= pos))
+        pos = node->io_pos;
+    else
+        pos = (rand() * pos) / RAND_MAX;
+    node->io_pos = pos;
     newPos = lseek64(node->my_fd, pos, SEEK_SET);
     if (newPos != (off_t)-1)
     {
@@ -1518,6 +3247,7 @@ void *IOThreadStart(void *arg)
     unsigned long long p;
     int activity;
     io_queue_node *node;
+    struct act_sample as;
 
     nTotalThreads++;
     nThreads++;
@@ -1561,11 +3291,13 @@ void *IOThreadStart(void *arg)
                 {
                     node->my_fd = mytinfo->my_fd;
                     nTriedIOTasks++;
+                    ActivityBegin(&as);
                     if (!ioFileRead(node))
                     {
                         if (verbose_flag)
                             printf("Read node failure of size %llu\n", node->io_len);
                     }
+                    ActivityEnd(&as, ACT_IO_READ, node->io_done);
                     node->my_fd = -1;
                     if (queueIODone(node))
                     {
@@ -1590,11 +3322,13 @@ void *IOThreadStart(void *arg)
                 {
                     node->my_fd = mytinfo->my_fd;
                     nTriedIOTasks++;
+                    ActivityBegin(&as);
                     if (!ioFileWrite(node))
                     {
                         if (verbose_flag)
                             printf ("Write (node) failure of size %llu\n", node->io_len);
                     }
+                    ActivityEnd(&as, ACT_IO_WRITE, node->io_done);
                     node->my_fd = -1;
                     if (queueIODone(node))
                     {
@@ -1636,6 +3370,10 @@ void *IOThreadStart(void *arg)
         EndAllThreads = true;
     }
 
+    ActivityThreadFlush();
+    if (perf_flag)
+        PerfThreadClose();
+
     if (Diagnose)
         printf("I/O thread %d ending\n", mytinfo->thread_num);
 
@@ -1681,7 +3419,7 @@ int SetupIOThreads(void)
 void *WorkerThreadStart(void *arg)
 {
     unsigned long long p;
-    bool ab, cd, memQueued;
+    bool ab, cd, memQueued, worked;
     bool endMe = false;
     char mChar;
     int activity, s, iotype;
@@ -1693,6 +3431,14 @@ void *WorkerThreadStart(void *arg)
     siginfo_t sigs;
     struct timespec waitfor;
     io_queue_node *node;
+    struct act_sample as;
+    unsigned long long doneBytes;
+    struct io_queue_node *nodePool;
+    struct trace_cursor trace = { NULL, NULL, NULL, 0, 0, 0, NULL };
+    const struct trace_rec *rp = NULL;
+    unsigned long long traceSize, tns;
+    long long ioPos;
+    int traceArg;
 
     nTotalThreads++;
     nThreads++;
@@ -1708,14 +3454,42 @@ void *WorkerThreadStart(void *arg)
         goto workerFinished;
     }
     memQueued = false;
+    nodePool = getIONodePool(mytinfo - wktinfo);
+    TraceThreadStart(&trace, mytinfo->thread_num);
 
     while (!EndAllThreads)
     {
-        activity = getActivity(7, mytinfo->thread_num);
+        if (TraceReplaying())
+        {
+            /* This worker's part of the trace is done, stay as long as it did */
+            rp = TraceNext(&trace);
+            if (rp == NULL)
+            {
+                for (tns = TraceEndDelayNs(&trace); (tns > 0) && !EndAllThreads; tns = TraceEndDelayNs(&trace))
+                    WorkerSleep(tns / 1000000000ULL, tns % 1000000000ULL);
+                break;
+            }
+            for (tns = TraceDelayNs(&trace, rp, true); (tns > 0) && !EndAllThreads; tns = TraceDelayNs(&trace, rp, false))
+                WorkerSleep(tns / 1000000000ULL, tns % 1000000000ULL);
+            if (EndAllThreads)
+                break;
+            activity = rp->activity;
+        }
+        else
+        {
+            activity = getActivity(7, mytinfo->thread_num);
+        }
+        doneBytes = 0;
+        traceSize = 0;
+        ioPos = -1;
+        traceArg = 0;
+        worked = true;
+        ActivityBegin(&as);
         switch(activity)
         {
             case 0:
                 /* Allocate some memory */
+                worked = (myMem == NULL);
                 if (myMem == NULL)
                 {
                     if (maxMem != 0)
@@ -1790,7 +3564,10 @@ void *WorkerThreadStart(void *arg)
                         sz = 4096;
 #endif
 
-                    myMem = CountingCalloc(1, sz);
+                    if (rp != NULL)
+                        sz = rp->size;
+                    traceSize = sz;
+                    myMem = WorkerMemAlloc(sz);
                     if (myMem == NULL)
                     {
                         printf("Worker thread %d: failed to allocate %llu bytes (",
@@ -1808,6 +3585,7 @@ void *WorkerThreadStart(void *arg)
                     }
                     else
                     {
+                        doneBytes = sz;
                         if (Diagnose)
                         {
                             dVal = memUsed.load(std::memory_order_relaxed);
@@ -1828,10 +3606,12 @@ void *WorkerThreadStart(void *arg)
 
             case 1:
                 /* Free any memory we have allocated */
+                worked = (myMem != NULL);
                 if (myMem != NULL)
                 {
-                    CountingFree(myMem);
+                    WorkerMemFree(myMem);
                     myMem = NULL;
+                    doneBytes = sz;
                     sz = 0;
                     if (Diagnose)
                     {
@@ -1852,16 +3632,19 @@ void *WorkerThreadStart(void *arg)
 
             case 2:
                 /* Zero any memory we have allocated (write) */
-                if ((myMem != NULL) && (sz > 0))
+                worked = ((myMem != NULL) && (sz > 0));
+                if (worked)
                 {
                     memset(myMem, 0, sz);
                     totalWrite += sz;
+                    doneBytes = sz;
                 }
                 break;
 
             case 3:
                 /* Read any memory we have allocated */
-                if ((myMem != NULL) && (sz > sizeof(sum)))
+                worked = ((myMem != NULL) && (sz > sizeof(sum)));
+                if (worked)
                 {
                     sum = 0;
                     num = sz / sizeof(sum);
@@ -1870,22 +3653,26 @@ void *WorkerThreadStart(void *arg)
                     {
                         sum += wspace[pos];
                     }
+                    /* Keep the compiler from dropping the scan */
+                    __asm__ __volatile__("" : : "r"(sum));
                     totalRead += (num * sizeof(sum));
+                    doneBytes = num * sizeof(sum);
                 }
                 break;
 
             case 4:
                 /* End this thread, another can be started by main if it's not the only one */
-                if (((nThreads - nIOThreads) > 0) && (rand() < RESTART_SCOPE))
+                if ((rp != NULL) ? (rp->arg != 0) : (((nThreads - nIOThreads) > 0) && (rand() < RESTART_SCOPE)))
                 {
                     if (Diagnose)
                         printf("Ending thread number %d (%d of %d)\n", mytinfo->thread_num, nThreads.load(std::memory_order_relaxed), nTotalThreads.load(std::memory_order_relaxed));
                     endMe = true;
                 }
+                traceArg = endMe;
                 break;
 
             case 5:
-                if (rand() % 2)
+                if ((rp != NULL) ? (rp->arg != 0) : (rand() % 2))
                 {
                     waitfor.tv_sec = 1;
                     waitfor.tv_nsec = 0;
@@ -1895,7 +3682,8 @@ void *WorkerThreadStart(void *arg)
                     waitfor.tv_sec = 0;
                     waitfor.tv_nsec = 100000;
                 }
-                s = sigtimedwait(&sigmask, &sigs, &waitfor);
+                traceArg = waitfor.tv_sec;
+                s = WorkerSigTimedWait(&sigmask, &sigs, &waitfor);
                 if (s < 0)
                 {
                     /* Reset the signal mask without changing it */
@@ -1912,30 +3700,52 @@ void *WorkerThreadStart(void *arg)
                 break;
 
             case 6:
+                /* Only a pass that queued I/O counts as a submit */
+                worked = false;
                 if ((myMem != NULL) && (nIOThreads > 0))
                 {
                     /* Let an I/O thread use our buffer */
-                    node = (io_queue_node *)calloc(1, sizeof(*node));
+                    if (nodePool == NULL)
+                        nodePool = getIONodePool(mytinfo - wktinfo);
+                    node = getPoolIONode(nodePool);
                     if (node != NULL)
                     {
                         node->io_buffer = myMem;
-                        node->io_len = (sz * rand()) / RAND_MAX;
+                        if (rp != NULL)
+                        {
+                            node->io_len = (rp->size < sz) ? rp->size : sz;
+                            node->io_pos = rp->offset;
+                        }
+                        else
+                        {
+                            node->io_len = (sz * rand()) / RAND_MAX;
+                        }
                         if (node->io_len < 1)
                             node->io_len = 1;
                         node->my_sem = &mytinfo->my_sem;
-                        iotype = getActivity(2, mytinfo->thread_num);
+                        node->my_fiber = InFiber() ? FiberGet(FiberCurrentSched()->current) : NULL;
+                        if (rp != NULL)
+                            iotype = rp->arg;
+                        else
+                            iotype = getActivity(2, mytinfo->thread_num);
+                        traceSize = node->io_len;
+                        traceArg = iotype;
                         if (iotype == 0)
-                        {
-                            if (queueIORead(node))
-                                nQueuedIOTasks++;
-                        }
+                            memQueued = queueIORead(node);
                         else
+                            memQueued = queueIOWrite(node);
+
+                        /* I/O is ending, nothing will ever complete this node */
+                        if (!memQueued)
                         {
-                            if (queueIOWrite(node))
-                                nQueuedIOTasks++;
+                            FiberPut(node->my_fiber);
+                            putPoolIONode(node);
+                            node = NULL;
+                            break;
                         }
-                        memQueued = true;
-                        
+                        nQueuedIOTasks++;
+                        worked = true;
+
                         /* Wait for completion */
                         do
                         {
@@ -1952,7 +3762,9 @@ void *WorkerThreadStart(void *arg)
                                         totalIORead += node->io_done;
                                     else
                                         totalIOWrite += node->io_done;
-                                    free(node);
+                                    doneBytes = node->io_done;
+                                    ioPos = node->io_pos;
+                                    putPoolIONode(node);
                                     node = NULL;
                                 }
                                 else
@@ -1964,7 +3776,7 @@ void *WorkerThreadStart(void *arg)
                             }
                             else
                             {
-                                sleep(1);
+                                WorkerWaitIO(node->my_sem);
                             }
                         } while (!EndAllThreads && (ts != 0));
                     }
@@ -1975,14 +3787,21 @@ void *WorkerThreadStart(void *arg)
                 if (Diagnose)
                     printf("Worker thread %d: IDLE (memory used is %llu)\n",
                             mytinfo->thread_num, memUsed.load(std::memory_order_relaxed));
-                sleep(1 + (rand() % 2));
+                traceArg = (rp != NULL) ? rp->arg : 1 + (rand() % 2);
+                WorkerSleep(traceArg, 0);
                 break;
         }
+        ActivityEnd(&as, !worked ? ACT_WK_SKIP : (activity < 0) ? ACT_WK_IDLE : activity, doneBytes);
+        TraceAppend(&trace, &as.start, (activity < 0) ? ACT_WK_IDLE : activity, traceSize, ioPos, traceArg);
+
+        /* Activities repeat for up to a second, let other fibers in */
+        if (fiber_mode)
+            FiberYield();
     };
     
     if ((myMem != NULL) && !memQueued)
     {
-        CountingFree(myMem);
+        WorkerMemFree(myMem);
         myMem = NULL;
     }
 
@@ -1993,6 +3812,13 @@ void *WorkerThreadStart(void *arg)
     }
 
 workerFinished:
+    TraceThreadEnd(&trace, mytinfo->thread_num, mytinfo->initial);
+
+    /* Scheduler threads keep their counter group for the other fibers */
+    ActivityThreadFlush();
+    if (perf_flag && !InFiber())
+        PerfThreadClose();
+
     if (Diagnose)
         printf("Worker thread %d ending\n", mytinfo->thread_num);
 
@@ -2028,22 +3854,30 @@ int getUnusedWorkThreadNum(void)
     return -1;
 }
 
-int startOneWorkThread(int wNum, pthread_attr_t *attr)
+/* tNum < 0 takes the next thread number, replay passes the recorded one */
+int startOneWorkThread(int wNum, pthread_attr_t *attr, int tNum)
 {
     int result, s, t;
+    bool initial;
 
     result = -1;
     
     if (pthread_mutex_lock(&wktilock) == 0)
     {
+        /* Launch workers get their slot, replacements find a free one */
+        initial = (wNum >= 0);
         if (wNum < 0)
             wNum = getUnusedWorkThreadNum();
         if (wNum >= 0)
         {
-            t = threadNum++;
+            t = (tNum < 0) ? threadNum++ : tNum;
             wktinfo[wNum].thread_num = t;
             wktinfo[wNum].argv_string = NULL;
-            s = pthread_create(&wktinfo[wNum].thread_id, attr, WorkerThreadStart, &wktinfo[wNum]);
+            wktinfo[wNum].initial = initial;
+            if (fiber_mode)
+                s = FiberSpawn(WorkerThreadStart, &wktinfo[wNum]);
+            else
+                s = pthread_create(&wktinfo[wNum].thread_id, attr, WorkerThreadStart, &wktinfo[wNum]);
             if (s != 0)
             {
                 if (verbose_flag)
@@ -2083,7 +3917,7 @@ int SetupWorkThreads(void)
     maxworkers = maxthreads - iothreads;
 
     wktinfo = (struct thread_info *)CountingCalloc(maxworkers, sizeof(struct thread_info));
-    if (wktinfo == NULL)
+    if ((wktinfo == NULL) || !SetupIONodePools(maxworkers))
     {
         if (verbose_flag)
             printf("Failed to allocate memory for thread info data\n");
@@ -2091,10 +3925,36 @@ int SetupWorkThreads(void)
         return -1;
     }
 
+    /* Replay starts the recorded launch workers with their thread numbers */
+    if (TraceReplaying())
+    {
+        minworkers = 0;
+        for (wnum = 0; (size_t)wnum < traceBlocks.size(); wnum++)
+        {
+            if ((traceBlocks[wnum] == NULL) || !(traceBlocks[wnum]->flags & TRACE_BLK_INITIAL))
+                continue;
+            if (minworkers == maxworkers)
+            {
+                printf("Trace has more launch workers than --maxthreads allows\n");
+                (void)pthread_attr_destroy(&attr);
+                return -1;
+            }
+            s = startOneWorkThread(minworkers, &attr, wnum);
+            if (s != 0)
+            {
+                if (verbose_flag)
+                    printf("Failed to create thread number %d\n", wnum);
+                (void)pthread_attr_destroy(&attr);
+                return s;
+            }
+            minworkers++;
+        }
+    }
+
     /* Create one thread for each worker */
-    for (tnum = 0; tnum < minworkers; tnum++)
+    for (tnum = TraceReplaying() ? minworkers : 0; tnum < minworkers; tnum++)
     {
-        s = startOneWorkThread(tnum, &attr);
+        s = startOneWorkThread(tnum, &attr, -1);
         if (s != 0)
         {
             if (verbose_flag)
@@ -2117,6 +3977,51 @@ int SetupWorkThreads(void)
     return 0;
 }
 
+/*
+ * Replay: start every recorded replacement worker that is due, sleeping
+ * between them, until untilNs. A replacement that finds no free slot yet
+ * is retried every millisecond.
+ */
+void TraceRunStarts(unsigned long long untilNs)
+{
+    const struct trace_block *blk;
+    pthread_attr_t attr;
+    unsigned long long now, ns;
+    struct timespec ts;
+    bool blocked;
+
+    while (!EndAllThreads)
+    {
+        now = TraceNowNs();
+        blocked = false;
+        while ((traceNextStart < traceStarts.size()) && (traceStarts[traceNextStart]->start_ns <= now))
+        {
+            blk = traceStarts[traceNextStart];
+            if (pthread_attr_init(&attr) != 0)
+            {
+                blocked = true;
+                break;
+            }
+            blocked = (startOneWorkThread(-1, &attr, blk->thread_num) != 0);
+            (void)pthread_attr_destroy(&attr);
+            if (blocked)
+                break;
+            traceNextStart++;
+        }
+        if (now >= untilNs)
+            break;
+
+        ns = untilNs - now;
+        if (blocked)
+            ns = (ns < 1000000ULL) ? ns : 1000000ULL;
+        else if ((traceNextStart < traceStarts.size()) && (traceStarts[traceNextStart]->start_ns - now < ns))
+            ns = traceStarts[traceNextStart]->start_ns - now;
+        ts.tv_sec = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+}
+
 time_t GetElapsed(time_t start, time_t finish)
 {
     time_t result = (time_t)-1;
@@ -2159,6 +4064,9 @@ int main(int argc, char*argv[])
         abort();
     }
 
+    if (fiber_test)
+        exit(FiberSelfTest() ? 0 : 1);
+
     start = (time_t)-1;
     tElapsed = start;
     dElapsed = 0.0;
@@ -2176,6 +4084,12 @@ int main(int argc, char*argv[])
         goto finished;
     }
 
+    if (!SetupWorkerMem())
+    {
+        printf("Failed to setup %s worker buffers\n", allocNames[allocBackend]);
+        goto finished;
+    }
+
     if (!setupDataFile())
     {
         printf("Failed to setup data file %s\n", ioFilename.c_str());
@@ -2205,6 +4119,20 @@ int main(int argc, char*argv[])
         printf("%llu B\n", memUsed.load(std::memory_order_relaxed));
     }
 
+    if (!TraceSetup())
+    {
+        EndAllThreads = true;
+        goto finished;
+    }
+
+    if (fiber_mode && !FiberEngineStart())
+    {
+        printf("Failed to start fiber schedulers\n");
+        EndAllThreads = true;
+        FiberEngineStop();
+        goto finished;
+    }
+
     if (SetupWorkThreads() == 0)
     {
         while (nThreads.load(std::memory_order_relaxed) < 1)
@@ -2241,7 +4169,8 @@ int main(int argc, char*argv[])
             break;
         }
 
-        if (short_threads && (!EndAllThreads) && (nThreads < maxthreads) && (rand() >= RESTART_SCOPE))
+        /* Replay starts replacements at their recorded times instead */
+        if (!TraceReplaying() && short_threads && (!EndAllThreads) && (nThreads < maxthreads) && (rand() >= RESTART_SCOPE))
         {
             if (verbose_flag)
                 printf("Want to start another thread\n");
@@ -2250,7 +4179,7 @@ int main(int argc, char*argv[])
             {
                 if (verbose_flag)
                     printf("Starting a new worker thread\n");
-                s = startOneWorkThread(-1, &attr);
+                s = startOneWorkThread(-1, &attr, -1);
                 if (s != 0)
                 {
                     if (verbose_flag)
@@ -2271,7 +4200,10 @@ int main(int argc, char*argv[])
             }
         }
 
-        sleep(1);
+        if (TraceReplaying())
+            TraceRunStarts(TraceNowNs() + 1000000000ULL);
+        else
+            sleep(1);
         tElapsed = GetElapsedFrom(start);
         i++;
         if (Diagnose)
@@ -2306,21 +4238,31 @@ finished:
     printf("    I/O read nodes = %llu remaining\n", pendingIOReads.load(std::memory_order_relaxed));
     printf("   I/O write nodes = %llu remaining\n", pendingIOWrites.load(std::memory_order_relaxed));
     printf("    I/O done nodes = %llu remaining\n", pendingIODone.load(std::memory_order_relaxed));
+    printf("   Node pool empty = %llu times\n", nIONodePoolEmpty.load(std::memory_order_relaxed));
     putchar('\n');
     clearIOReadQ();
     clearIOWriteQ();
     clearIODoneQ();
+    FreeIONodePools();
+    TraceCleanup();
 
     if (!cleanupDataFile())
         printf("  Failed to close/delete data file %s\n", ioFilename.c_str());
 
     (void)destroySyncObjects();
+    CleanupWorkerMem();
 
     puts("Thread/Memory Data:");
     printf("     Total threads = %d\n", nTotalThreads.load(std::memory_order_relaxed));
     printf("      Peak threads = %d\n", nPeakThreads.load(std::memory_order_relaxed));
     printf("   End I/O threads = %d\n", nIOThreads.load(std::memory_order_relaxed));
     printf("       End threads = %d\n", nThreads.load(std::memory_order_relaxed));
+    if (fiber_mode)
+    {
+        printf("  Fiber schedulers = %u\n", schedthreads);
+        printf("    Fiber switches = %llu\n", nFiberSwitches.load(std::memory_order_relaxed));
+        printf("      Fiber steals = %llu\n", nFiberSteals.load(std::memory_order_relaxed));
+    }
     dVal = memUsed.load(std::memory_order_relaxed);
     mChar = 0;
     printf("   End memory used = ");
@@ -2356,6 +4298,13 @@ finished:
         printf("%llu B\n", totalWrite.load(std::memory_order_relaxed));
     }
     printf("   Set signal mask = %llu times\n", nSigMaskSets.load(std::memory_order_relaxed));
+    if (traceRecordName.length() > 0)
+        printf("     Trace records = %llu written\n", nTraceRecords.load(std::memory_order_relaxed));
+    if (traceReplayName.length() > 0)
+        printf("     Trace records = %llu replayed, %llu started late\n",
+               nTraceRecords.load(std::memory_order_relaxed), nTraceLate.load(std::memory_order_relaxed));
+    if (allocBackend == ALLOC_HUGETLB)
+        printf("   Huge pool empty = %llu times\n", nHugePoolEmpty.load(std::memory_order_relaxed));
     putchar('\n');
 
     if (dElapsed != 0.0)
@@ -2402,6 +4351,10 @@ finished:
         putchar('\n');
     }
 
+    ShowActivityBandwidth();
+    if (perf_flag)
+        ShowActivityCounters();
+
     puts("I/O Data (final):");
     dVal = totalTriedIORead.load(std::memory_order_relaxed);
     mChar = 0;